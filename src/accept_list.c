@@ -0,0 +1,308 @@
+/* accept_list.c - Controller side advert filtering
+ *
+ *   Beacon addresses we care about are loaded into the controller's
+ *   LE Filter Accept List and scanning is switched to filter_policy
+ *   0x01, so adverts from everything else never wake the host.
+ *
+ *   Addresses come from the static accept_list setting, or are
+ *   learned from iBeacons advertising one of the accept_uuids. To
+ *   discover new beacons the filter is opened for
+ *   ACCEPT_LIST_LEARN_WINDOW_SEC every ACCEPT_LIST_LEARN_INTERVAL_SEC;
+ *   learned addresses are forgotten once the beacon goes quiet.
+ *
+ *   LE commands need CAP_NET_RAW, which the child drops. The child
+ *   keeps the list and decides the policy; the privileged parent is
+ *   asked over IPC to load it and restart scanning, and answers with
+ *   the policy scanning resumed with. The controller's list size is
+ *   read before the fork.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "accept_list.h"
+#include "ble.h"
+#include "config.h"
+#include "ipc.h"
+#include "log.h"
+#include "time_util.h"
+
+typedef struct accept_entry {
+    uint8_t addr[6]; /* HCI (little endian) byte order */
+    bool learned;
+    double last_seen;
+} accept_entry_t;
+
+static accept_entry_t accept_list[ACCEPT_LIST_MAX];
+static uint8_t accept_uuids[ACCEPT_UUID_MAX][16];
+static size_t accept_uuid_count = 0;
+
+static accept_list_stats_t accept_stats = {0};
+
+/* Host list differs from what the controller holds */
+static bool accept_dirty = false;
+static double accept_learn_until = 0, accept_learn_next = 0;
+
+/* An update the parent hasn't answered yet */
+static bool accept_busy = false;
+static uint32_t accept_serial = 0;
+static uint8_t accept_requested = 0x00;
+
+extern struct bufferevent *ipc_bev;
+
+accept_list_stats_t const *accept_list_get_stats(void) {
+    return &accept_stats;
+}
+
+static accept_entry_t *accept_list_find(uint8_t const *const addr) {
+    for (size_t i = 0; i < accept_stats.entries; i++) {
+        if (!memcmp(accept_list[i].addr, addr, 6)) {
+            return &accept_list[i];
+        }
+    }
+    return NULL;
+}
+
+static bool accept_uuid_p(uint8_t const *const uuid) {
+    for (size_t i = 0; i < accept_uuid_count; i++) {
+        if (!memcmp(accept_uuids[i], uuid, 16)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static accept_entry_t *accept_list_add(uint8_t const *const addr,
+                                       bool learned, double ts) {
+    if (accept_stats.entries >= ACCEPT_LIST_MAX) {
+        return NULL;
+    }
+    accept_entry_t *e = &accept_list[accept_stats.entries++];
+    memcpy(e->addr, addr, 6);
+    e->learned = learned;
+    e->last_seen = ts;
+    accept_dirty = true;
+    return e;
+}
+
+bool accept_list_admit(uint8_t const *const addr, uint8_t const *const uuid,
+                       double ts)
+/* Host side half of the filter; returns false if the advert should be
+   dropped. uuid is NULL for beacons that don't advertise one */
+{
+    if (!accept_stats.enabled) {
+        return true;
+    }
+    accept_entry_t *e = accept_list_find(addr);
+    if (e) {
+        e->last_seen = ts;
+        return true;
+    }
+    if (uuid && accept_uuid_p(uuid)) {
+        if (!accept_list_add(addr, true, ts)) {
+            log_warn("Accept list full, beacon not tracked");
+            accept_stats.rejected++;
+            return false;
+        }
+        return true;
+    }
+    accept_stats.rejected++;
+    return false;
+}
+
+static bool accept_list_load(int dd, uint8_t (*addrs)[6], size_t n)
+/* Replace a controller's list with addrs */
+{
+    if (hci_le_clear_white_list(dd, 1000) < 0) {
+        log_error("Failed to clear accept list: %s", strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        bdaddr_t ba;
+        memcpy(&ba, addrs[i], sizeof(ba));
+        if (hci_le_add_white_list(dd, &ba, BLE_ADDR_RANDOM, 1000) < 0) {
+            log_error("Failed to add to accept list: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+uint8_t accept_list_apply(char const *policy, char const *addrs)
+/* Parent side: load the hex encoded addrs into every adapter and
+   restart scanning with the requested policy. Returns the policy
+   scanning resumed with */
+{
+    uint8_t list[ACCEPT_LIST_MAX][6];
+    uint8_t filter_policy = policy && atoi(policy) == 0x01 ? 0x01 : 0x00;
+    size_t n = 0;
+    for (char const *p = addrs; p && n < ACCEPT_LIST_MAX; p += 12, n++) {
+        uint8_t *a = list[n];
+        if (sscanf(p, "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &a[0], &a[1], &a[2],
+                   &a[3], &a[4], &a[5]) != 6) {
+            break;
+        }
+    }
+
+    if (ble_scan_pause() < 0) {
+        log_warn("Failed to pause scan for accept list update: %s",
+                 strerror(errno));
+    }
+    for (size_t i = 0; filter_policy == 0x01 && i < ble_adapter_count();
+         i++) {
+        if (!accept_list_load(ble_get_adapter(i)->cmd_dd, list, n)) {
+            filter_policy = 0x00;
+        }
+    }
+    if (ble_scan_resume(filter_policy) < 0) {
+        log_error("Failed to resume scan after accept list update");
+    }
+    return filter_policy;
+}
+
+static void accept_list_program(uint8_t filter_policy)
+/* Ask the parent to load our list into every adapter and restart
+   scanning with the requested policy */
+{
+    char policy[4];
+    char addrs[ACCEPT_LIST_MAX * 12 + 1] = "";
+    snprintf(policy, sizeof(policy), "%u", filter_policy);
+    for (size_t i = 0; i < accept_stats.entries; i++) {
+        uint8_t const *a = accept_list[i].addr;
+        sprintf(addrs + 12 * i, "%02x%02x%02x%02x%02x%02x", a[0], a[1], a[2],
+                a[3], a[4], a[5]);
+    }
+    ipc_cmd_t *cmd = ipc_cmd_accept_list(policy, addrs);
+    if (!cmd) {
+        log_error("Failed to allocate memory");
+        return;
+    }
+    ipc_cmd_list_t list = {
+        .serial = ipc_get_serial(), .num = 1, .entries = &cmd};
+    ipc_cmd_list_send(ipc_bev, &list);
+    ipc_cmd_free(cmd);
+    accept_busy = true;
+    accept_serial = list.serial;
+    accept_requested = filter_policy;
+    accept_dirty = false;
+}
+
+bool accept_list_pending(uint32_t serial) {
+    return accept_busy && serial == accept_serial;
+}
+
+void accept_list_applied(char const *resp)
+/* The parent's answer to accept_list_program */
+{
+    uint8_t filter_policy = resp && atoi(resp) == 0x01 ? 0x01 : 0x00;
+    if (filter_policy != accept_requested) {
+        /* Retried on the next sync */
+        log_warn("Accept list not loaded, scanning unfiltered");
+    }
+    accept_stats.filter_policy = filter_policy;
+    accept_stats.syncs++;
+    accept_busy = false;
+}
+
+static void accept_list_sync(evutil_socket_t fd, short what, void *arg) {
+    UNUSED(fd);
+    UNUSED(what);
+    UNUSED(arg);
+    double now = time_now();
+
+    if (accept_busy) {
+        return;
+    }
+
+    /* Forget learned beacons that have gone quiet */
+    for (size_t i = 0; i < accept_stats.entries;) {
+        accept_entry_t *e = &accept_list[i];
+        if (e->learned && now - e->last_seen > MAX_BEACON_INACTIVE_SEC) {
+            *e = accept_list[--accept_stats.entries];
+            accept_dirty = true;
+        } else {
+            i++;
+        }
+    }
+
+    if (accept_uuid_count) {
+        if (accept_stats.learning && now >= accept_learn_until) {
+            accept_stats.learning = false;
+            accept_learn_next = now + ACCEPT_LIST_LEARN_INTERVAL_SEC;
+        } else if (!accept_stats.learning && now >= accept_learn_next) {
+            accept_stats.learning = true;
+            accept_learn_until = now + ACCEPT_LIST_LEARN_WINDOW_SEC;
+        }
+    }
+
+    uint8_t filter_policy = 0x00;
+    if (!accept_stats.learning && accept_stats.entries > 0 &&
+        accept_stats.entries <= accept_stats.controller_size) {
+        filter_policy = 0x01;
+    }
+    if (filter_policy != accept_stats.filter_policy ||
+        (filter_policy && accept_dirty)) {
+        accept_list_program(filter_policy);
+    }
+}
+
+void accept_list_probe(void)
+/* Read how many addresses the controllers hold, before the fork while
+   we can still send them commands */
+{
+    uint8_t addrs[ACCEPT_LIST_MAX][6];
+    if (!config_get_accept_list(addrs, ACCEPT_LIST_MAX) &&
+        !config_get_accept_uuids(accept_uuids, ACCEPT_UUID_MAX)) {
+        return;
+    }
+    /* The smallest controller limits the list for all of them */
+    uint8_t smallest = UINT8_MAX;
+    for (size_t i = 0; i < ble_adapter_count(); i++) {
+        uint8_t size;
+        if (hci_le_read_white_list_size(ble_get_adapter(i)->cmd_dd, &size,
+                                        1000) < 0) {
+            log_error("Failed to read accept list size: %s", strerror(errno));
+            return;
+        }
+        if (size < smallest) {
+            smallest = size;
+        }
+    }
+    accept_stats.controller_size = smallest;
+}
+
+void accept_list_init(struct event_base *base) {
+    uint8_t addrs[ACCEPT_LIST_MAX][6];
+    size_t n = config_get_accept_list(addrs, ACCEPT_LIST_MAX);
+    accept_uuid_count = config_get_accept_uuids(accept_uuids, ACCEPT_UUID_MAX);
+    if ((!n && !accept_uuid_count) || !accept_stats.controller_size) {
+        return;
+    }
+
+    double now = time_now();
+    for (size_t i = 0; i < n; i++) {
+        accept_list_add(addrs[i], false, now);
+    }
+    log_notice("Accept list: %zu addresses, %zu UUIDs, controller holds %d", n,
+               accept_uuid_count, accept_stats.controller_size);
+    accept_stats.enabled = true;
+    /* Scanning starts unfiltered; learn before locking the filter */
+    if (accept_uuid_count) {
+        accept_stats.learning = true;
+        accept_learn_until = now + ACCEPT_LIST_LEARN_WINDOW_SEC;
+    }
+    accept_list_sync(-1, 0, NULL);
+
+    struct event *ev = event_new(base, -1, EV_PERSIST, accept_list_sync, NULL);
+    struct timeval tv = {ACCEPT_LIST_SYNC_SEC, 0};
+    evtimer_add(ev, &tv);
+}
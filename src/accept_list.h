@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#define ACCEPT_LIST_MAX 128 /* Addresses tracked host side */
+#define ACCEPT_UUID_MAX 16
+#define ACCEPT_LIST_SYNC_SEC 5 /* How often the controller list is resynced */
+#define ACCEPT_LIST_LEARN_INTERVAL_SEC                                        \
+    60 /* How often the filter is opened to                                    \
+          discover beacons with accepted UUIDs */
+#define ACCEPT_LIST_LEARN_WINDOW_SEC ACCEPT_LIST_SYNC_SEC
+
+typedef struct accept_list_stats {
+    bool enabled;
+    bool learning;
+    uint8_t filter_policy;
+    uint8_t controller_size;
+    size_t entries;
+    uint64_t rejected; /* Adverts dropped host side */
+    uint64_t syncs;    /* Times the controller list was reprogrammed */
+} accept_list_stats_t;
+
+void accept_list_probe(void);
+void accept_list_init(struct event_base *);
+uint8_t accept_list_apply(char const *, char const *);
+bool accept_list_pending(uint32_t);
+void accept_list_applied(char const *);
+bool accept_list_admit(uint8_t const *const, uint8_t const *const, double);
+accept_list_stats_t const *accept_list_get_stats(void);
@@ -0,0 +1,86 @@
+/* admission.c - Probation for new secure beacon addresses
+ *
+ *   Anything with a random static address and a 30 byte advert looks
+ *   like a secure beacon, so phones and other privacy rotating devices
+ *   would each get a table entry and a Kalman filter until they time
+ *   out. Instead an address must be heard admission_sightings times
+ *   within ADMISSION_WINDOW_SEC before it becomes a beacon.
+ *
+ *   Sightings are counted in a count-min sketch, so probation costs a
+ *   fixed 32kB however many addresses pass by. The sketch has two
+ *   generations that rotate every window; an address's count is what
+ *   both hold, which covers at least the last window.
+ */
+
+#include <string.h>
+
+#include "admission.h"
+#include "config.h"
+#include "hash.h"
+#include "log.h"
+
+#define ADMISSION_MASK (ADMISSION_SKETCH_WIDTH - 1)
+
+static uint8_t admission_sketch[2][ADMISSION_SKETCH_DEPTH]
+                               [ADMISSION_SKETCH_WIDTH];
+static int admission_cur = 0;
+static double admission_rotate_at = 0;
+static bool admission_ready = false;
+
+static admission_stats_t admission_stats = {0};
+
+admission_stats_t const *admission_get_stats(void) {
+    return &admission_stats;
+}
+
+static void admission_init(double ts) {
+    int sightings = config_get_admission_sightings();
+    admission_stats.enabled = sightings > 1;
+    admission_stats.sightings = sightings > UINT8_MAX ? UINT8_MAX : sightings;
+    admission_rotate_at = ts + ADMISSION_WINDOW_SEC;
+    admission_ready = true;
+}
+
+bool admission_admit(beacon_key_t key, double ts)
+/* Count a sighting of an address not yet tracked; true once it has
+   been seen often enough to become a beacon */
+{
+    if (!admission_ready) {
+        admission_init(ts);
+    }
+    if (!admission_stats.enabled) {
+        return true;
+    }
+    if (ts >= admission_rotate_at) {
+        /* Forget the older generation; after a long gap, both */
+        admission_cur ^= 1;
+        if (ts >= admission_rotate_at + ADMISSION_WINDOW_SEC) {
+            memset(admission_sketch, 0, sizeof(admission_sketch));
+        } else {
+            memset(admission_sketch[admission_cur], 0,
+                   sizeof(admission_sketch[admission_cur]));
+        }
+        admission_rotate_at = ts + ADMISSION_WINDOW_SEC;
+    }
+
+    /* One keyed hash gives a counter index for every row */
+    uint64_t h = hash_u64(key);
+    unsigned count = UINT8_MAX;
+    for (int row = 0; row < ADMISSION_SKETCH_DEPTH; row++) {
+        size_t i = (h >> (16 * row)) & ADMISSION_MASK;
+        uint8_t *c = &admission_sketch[admission_cur][row][i];
+        if (*c < UINT8_MAX) {
+            (*c)++;
+        }
+        unsigned both = *c + admission_sketch[admission_cur ^ 1][row][i];
+        if (both < count) {
+            count = both;
+        }
+    }
+    if (count >= admission_stats.sightings) {
+        admission_stats.admitted++;
+        return true;
+    }
+    admission_stats.rejected++;
+    return false;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "beacon.h"
+
+#define ADMISSION_WINDOW_SEC 10.0 /* Sightings must fall within this */
+#define ADMISSION_SKETCH_WIDTH 4096 /* Counters per row, a power of 2 */
+#define ADMISSION_SKETCH_DEPTH 4
+
+typedef struct admission_stats {
+    bool enabled;
+    uint8_t sightings; /* Needed before an address is tracked */
+    uint64_t admitted; /* Addresses promoted to beacons */
+    uint64_t rejected; /* Adverts from addresses still on probation */
+} admission_stats_t;
+
+bool admission_admit(beacon_key_t, double);
+admission_stats_t const *admission_get_stats(void);
@@ -1,6 +1,5 @@
-#include <assert.h>
-#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,127 +7,507 @@
 #include "beacon.h"
 #include "ble.h"
 #include "config.h"
-#include "hash.h"
 #include "log.h"
+#include "pool.h"
 #include "time_util.h"
 
-uint32_t beacon_index(void *a) {
-    beacon_t *b = a;
-    uint32_t index = 0;
-    if (b->type == BEACON_IBEACON) {
-        struct ibeacon_id *id = b->id;
-        for (int i = 0; i < 16; i++) {
-            index += id->uuid[i];
-        }
-        index += id->major + id->minor;
-    } else if (b->type == BEACON_SECURE) {
-        struct sbeacon_id *id = b->id;
-        for (int i = 0; i < 6; i++) {
-            index += id->mac[i];
+static void *beacon_calloc(size_t, size_t);
+static void beacon_free(void *);
+#define HASH_CALLOC beacon_calloc
+#define HASH_FREE beacon_free
+#include "hash.h"
+
+static beacon_stats_t beacon_stats = {0};
+static uint64_t beacon_table_allocs = 0, beacon_table_frees = 0;
+
+static void *beacon_calloc(size_t n, size_t size)
+/* All beacon table memory comes through here, and beacons themselves
+   from beacon_pool, so the per advert path can be checked for
+   allocations */
+{
+    beacon_table_allocs++;
+    return calloc(n, size);
+}
+
+static void beacon_free(void *p) {
+    if (p) {
+        beacon_table_frees++;
+    }
+    free(p);
+}
+
+typedef struct beacon_uuid_key {
+    uint8_t uuid[16];
+} beacon_uuid_key_t;
+
+HASH_TABLE_DEFINE(beacon_table, beacon_key_t, beacon_t *)
+HASH_TABLE_DEFINE(uuid_table, beacon_uuid_key_t, uint16_t)
+
+static beacon_table_t beacons = {0};
+static size_t beacon_count[2] = {0}; /* By type */
+/* UUIDs by index, and the index of each UUID */
+static beacon_uuid_key_t beacon_uuids[BEACON_UUID_MAX];
+static uuid_table_t uuid_index = {0};
+static bool beacon_uuids_full = false;
+static pool_t beacon_pool = {0};
+static bool beacon_pool_full = false;
+static size_t beacon_max = 0;
+static kalman_store_t beacon_filter_store = {0};
+/* Kalman profile of each interned UUID, resolved on first use under
+   the config generation below; 0xff until then */
+static uint8_t beacon_uuid_profile[BEACON_UUID_MAX];
+static uint64_t beacon_profile_generation = 0;
+/* Every beacon, least recently heard first; the head is evicted when
+   a new beacon would go over max_beacons or beacon_memory_kb */
+static TAILQ_HEAD(beacon_lru_list, ibeacon)
+    beacon_lru = TAILQ_HEAD_INITIALIZER(beacon_lru);
+/* Every beacon in the order added, and the cursors walking them */
+static TAILQ_HEAD(beacon_all_list, ibeacon)
+    beacon_all = TAILQ_HEAD_INITIALIZER(beacon_all);
+static uint64_t beacon_serial = 0;
+static TAILQ_HEAD(beacon_cursor_list, beacon_cursor)
+    beacon_cursors = TAILQ_HEAD_INITIALIZER(beacon_cursors);
+/* Copies of evicted beacons whose counts are still to be reported */
+static beacon_t beacon_evicted[BEACON_EVICT_FLUSH_MAX];
+static size_t beacon_evicted_len = 0;
+/* Each beacon is armed to expire MAX_BEACON_INACTIVE_SEC after it was
+   last heard */
+static wheel_t beacon_wheel;
+static bool beacon_wheel_ready = false;
+static struct event *beacon_gc_ev = NULL;
+/* iBeacons heard since the last report, in the order first heard */
+static TAILQ_HEAD(beacon_dirty_list, ibeacon)
+    beacon_dirty = TAILQ_HEAD_INITIALIZER(beacon_dirty);
+
+static uint64_t beacon_tick(double t) {
+    return t > 0 ? (uint64_t)(t / BEACON_WHEEL_TICK_SEC) : 0;
+}
+
+static void beacon_arm(beacon_t *b, double last_seen) {
+    if (!beacon_wheel_ready) {
+        wheel_init(&beacon_wheel, beacon_tick(time_now()));
+        beacon_wheel_ready = true;
+    }
+    /* The tick after the deadline, so it has passed when we fire */
+    wheel_add(&beacon_wheel, &b->expiry,
+              beacon_tick(last_seen + MAX_BEACON_INACTIVE_SEC) + 1);
+}
+
+int beacon_uuid_intern(uint8_t const *uuid)
+/* Index of uuid, added if new; -1 once BEACON_UUID_MAX are known */
+{
+    /* Sites use a handful of UUIDs, most adverts repeat the last one */
+    static int last = -1;
+    if (last >= 0 && !memcmp(beacon_uuids[last].uuid, uuid, 16)) {
+        return last;
+    }
+    beacon_uuid_key_t key;
+    memcpy(key.uuid, uuid, 16);
+    uint16_t *idx = uuid_table_find(&uuid_index, &key);
+    if (idx) {
+        return last = *idx;
+    }
+    if (uuid_index.used >= BEACON_UUID_MAX) {
+        if (!beacon_uuids_full) {
+            log_error("More than %d iBeacon UUIDs seen, ignoring new ones",
+                      BEACON_UUID_MAX);
         }
-    } else {
-        log_error("Unknown beacon type in hash: %d", b->type);
-        assert(false);
+        beacon_uuids_full = true;
+        return -1;
     }
-    return index;
+    bool found;
+    if (!(idx = uuid_table_insert(&uuid_index, &key, &found))) {
+        log_error("Failed to grow UUID table");
+        return -1;
+    }
+    *idx = uuid_index.used - 1;
+    beacon_uuids[*idx] = key;
+    return last = *idx;
+}
+
+uint8_t const *beacon_uuid(uint16_t idx) {
+    return beacon_uuids[idx].uuid;
 }
 
-bool beacon_eq(void *a, void *b) {
-    beacon_t *aa = a, *bb = b;
-    if (!(aa->type == bb->type)) {
+static bool beacon_evict(void)
+/* Make room by dropping the least recently heard beacon. Counts it
+   has not yet reported go out with the next report */
+{
+    beacon_t *b = TAILQ_FIRST(&beacon_lru);
+    if (!b) {
         return false;
     }
-    if (aa->type == BEACON_IBEACON) {
-        struct ibeacon_id *id_a = aa->id, *id_b = bb->id;
-        /* log_debug("%d == %d, %d == %d, UUID Result: %d\n", */
-        /* 	     aa->major, bb->major, aa->minor, bb->minor,
-         * !memcmp(aa->uuid,
-         * bb->uuid, 16)); */
-        return (id_a->major == id_b->major && id_a->minor == id_b->minor &&
-                !memcmp(id_a->uuid, id_b->uuid, 16));
-    } else if (aa->type == BEACON_SECURE) {
-        struct sbeacon_id *id_a = aa->id, *id_b = bb->id;
-        return !memcmp(id_a->mac, id_b->mac, 6);
-    }
-    log_error("Unknown beacon type in hash: %d", bb->type);
-    assert(false);
-    return false;
-}
-
-beacon_t *ibeacon_find_or_add(uint8_t const *const uuid, uint16_t major,
-                              uint16_t minor) {
-    beacon_t *b = malloc(sizeof(beacon_t)), *ret;
-    memset(b, 0, sizeof(beacon_t));
-    b->type = BEACON_IBEACON;
-    struct ibeacon_id *id = malloc(sizeof(struct ibeacon_id));
-    memcpy(id->uuid, uuid, 16);
-    id->major = major;
-    id->minor = minor;
-    b->id = id;
-    b->kalman.init = false;
-    /* log_debug("%d == %d, %d == %d\n", major, b->major, minor, b->minor); */
-    ret = hash_add(b, beacon_index, beacon_eq);
-    if (ret != b) {
-        /* If the beacon already exists, hash_add will return its existing
-           address; we then need to free our temporary copy. If they are
-           the same, our temporary copy has been linked into the
-           hashtable */
-        beacon_delete(b);
-    } else {
-        /* Finish initialization on node, if new */
-        b->last_report = NAN;
-        log_notice("Acquired ibeacon maj=%d min=%d", id->major, id->minor);
-    }
-    return ret;
-}
-
-beacon_t *sbeacon_find_or_add(uint8_t *mac) {
-    beacon_t *b = malloc(sizeof(beacon_t)), *ret;
-    memset(b, 0, sizeof(beacon_t));
-    b->type = BEACON_SECURE;
-    struct sbeacon_id *id = malloc(sizeof(struct sbeacon_id));
-    memcpy(id->mac, mac, 6);
-    b->id = id;
-    b->kalman.init = false;
-    /* log_debug("%d == %d, %d == %d\n", major, b->major, minor, b->minor); */
-    ret = hash_add(b, beacon_index, beacon_eq);
-    if (ret != b) {
-        /* If the beacon already exists, hash_add will return its existing
-           address; we then need to free our temporary copy. If they are
-           the same, our temporary copy has been linked into the
-           hashtable */
-        beacon_delete(b);
-    } else {
-        /* Finish initialization on node, if new */
-        b->last_report = NAN;
-        char *mac = hexlify(id->mac, 6);
-        log_notice("Acquired secure beacon id=%s", mac);
-        free(mac);
+    if (b->dirty.tqe_prev) {
+        if (beacon_evicted_len < BEACON_EVICT_FLUSH_MAX) {
+            beacon_evicted[beacon_evicted_len++] = *b;
+        } else {
+            beacon_stats.unflushed++;
+        }
+    }
+    if (!beacon_stats.evicted) {
+        log_warn("Beacon limit reached, evicting least recently heard");
     }
-    return ret;
+    beacon_stats.evicted++;
+    beacon_remove(b);
+    return true;
 }
 
-void beacon_delete(void *v) {
-    beacon_t *b = v;
-    free(b->id);
-    free(b);
+static beacon_t *beacon_new(uint8_t type) {
+    if (!beacon_pool.obj_size) {
+        pool_init(&beacon_pool, sizeof(beacon_t), config_get_beacon_memory());
+        beacon_max = config_get_max_beacons();
+        if (beacon_max && beacon_max < BEACON_MAX_MIN) {
+            beacon_max = BEACON_MAX_MIN;
+        }
+        /* The memory cap must hold as many, or evicting for a new
+           beacon could recycle one with an advert queued */
+        size_t min_bytes = (BEACON_MAX_MIN + beacon_pool.per_slab - 1) /
+                           beacon_pool.per_slab * POOL_SLAB_SIZE;
+        if (beacon_pool.cap && beacon_pool.cap < min_bytes) {
+            beacon_pool.cap = min_bytes;
+        }
+    }
+    if (beacon_max &&
+        beacon_count[BEACON_IBEACON] + beacon_count[BEACON_SECURE] >=
+            beacon_max) {
+        beacon_evict();
+    }
+    beacon_t *b = pool_alloc(&beacon_pool);
+    if (!b && beacon_evict()) {
+        b = pool_alloc(&beacon_pool);
+    }
+    if (!b) {
+        /* Say so once, not for every advert while we're full */
+        if (!beacon_pool_full) {
+            log_error("Beacon memory limit of %zu bytes reached, ignoring "
+                      "new beacons",
+                      beacon_pool.cap);
+        }
+        beacon_pool_full = true;
+        return NULL;
+    }
+    beacon_pool_full = false;
+    int64_t filter = kalman_store_alloc(&beacon_filter_store);
+    if (filter < 0) {
+        log_error("Failed to grow Kalman filter store");
+        pool_free(&beacon_pool, b);
+        return NULL;
+    }
+    b->filter = filter;
+    beacon_filter_store.slots[filter].last_seen = time_now();
+    b->type = type;
+    TAILQ_INSERT_TAIL(&beacon_lru, b, lru);
+    TAILQ_INSERT_TAIL(&beacon_all, b, all);
+    b->serial = ++beacon_serial;
+    beacon_arm(b, time_now());
+    return b;
 }
 
-void *beacon_expire(void *a, void *c) {
-    beacon_t *b = a;
-    double now_ts;
-    if (c != NULL) {
-        now_ts = *(double *)c;
+beacon_t *beacon_find(beacon_key_t key) {
+    beacon_t **b = beacon_table_find(&beacons, &key);
+    return b ? *b : NULL;
+}
+
+beacon_t *beacon_find_or_add(beacon_key_t key)
+/* Allocates only the first time key is seen */
+{
+    bool found;
+    beacon_t **slot = beacon_table_insert(&beacons, &key, &found);
+    if (found) {
+        return *slot;
+    }
+    uint8_t type = key & BEACON_KEY_SECURE ? BEACON_SECURE : BEACON_IBEACON;
+    beacon_t *b = slot ? beacon_new(type) : NULL;
+    if (!b) {
+        if (slot) {
+            beacon_table_remove(&beacons, &key);
+        } else {
+            log_error("Failed to grow beacon table");
+        }
+        return NULL;
+    }
+    b->key = key;
+    *slot = b;
+    beacon_count[type]++;
+    if (type == BEACON_IBEACON) {
+        log_notice("Acquired ibeacon maj=%d min=%d", IBEACON_KEY_MAJOR(key),
+                   IBEACON_KEY_MINOR(key));
     } else {
-        now_ts = time_now();
+        uint8_t mac[6];
+        sbeacon_key_mac(key, mac);
+        char *hex = hexlify(mac, 6);
+        log_notice("Acquired secure beacon id=%s", hex);
+        free(hex);
     }
-    /* log_debug("%f - %f = %f\n", b->kalman.last_seen, now_ts,
-     * b->kalman.last_seen - now_ts); */
-    if (now_ts - b->kalman.last_seen > MAX_BEACON_INACTIVE_SEC) {
-        log_debug("Beacon pruned\n");
-        a = NULL; /* Alert the parent that we cannot dereference */
-        hash_delete(b, beacon_index, beacon_eq, beacon_delete);
+    return b;
+}
+
+void beacon_cursor_open(beacon_cursor_t *c) {
+    c->next = TAILQ_FIRST(&beacon_all);
+    c->end = beacon_serial;
+    TAILQ_INSERT_TAIL(&beacon_cursors, c, link);
+}
+
+beacon_t *beacon_cursor_next(beacon_cursor_t *c)
+/* The next beacon, or NULL once the walk is done. Beacons added since
+   the cursor was opened are not visited */
+{
+    beacon_t *b = c->next;
+    if (!b || b->serial > c->end) {
+        return NULL;
+    }
+    c->next = TAILQ_NEXT(b, all);
+    return b;
+}
+
+void beacon_cursor_close(beacon_cursor_t *c) {
+    TAILQ_REMOVE(&beacon_cursors, c, link);
+}
+
+void beacon_walk(beacon_walker_t func, void *arg)
+/* Call func on every tracked beacon; func may remove any beacon */
+{
+    beacon_cursor_t c;
+    beacon_t *b;
+    beacon_cursor_open(&c);
+    while ((b = beacon_cursor_next(&c))) {
+        func(b, arg);
+    }
+    beacon_cursor_close(&c);
+}
+
+struct beacon_slicer {
+    beacon_cursor_t cursor;
+    beacon_walker_t func;
+    void (*done)(void *);
+    void *arg;
+    double budget;
+    struct event *ev;
+};
+
+static void beacon_slice_cb(evutil_socket_t fd, short what, void *arg)
+/* Walk on until the budget is spent, then give the loop back */
+{
+    UNUSED(fd);
+    UNUSED(what);
+    beacon_slicer_t *s = arg;
+    double deadline = time_monotonic() + s->budget;
+    unsigned n = 0;
+    beacon_t *b;
+    beacon_stats.slices++;
+    while ((b = beacon_cursor_next(&s->cursor))) {
+        s->func(b, s->arg);
+        /* Reading the clock costs more than most walkers */
+        if (++n % BEACON_SLICE_CHECK == 0 && time_monotonic() >= deadline) {
+            struct timeval tv = {0, 0};
+            evtimer_add(s->ev, &tv);
+            return;
+        }
+    }
+    void (*done)(void *) = s->done;
+    void *done_arg = s->arg;
+    beacon_walk_cancel(s);
+    if (done) {
+        done(done_arg);
+    }
+}
+
+beacon_slicer_t *beacon_walk_sliced(struct event_base *base,
+                                    beacon_walker_t func, void (*done)(void *),
+                                    void *arg)
+/* Call func on every beacon, as beacon_walk, in slices of at most
+   walk_budget_usec so the event loop keeps running; then done. NULL if
+   the walk could not be started */
+{
+    beacon_slicer_t *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    if (!(s->ev = evtimer_new(base, beacon_slice_cb, s))) {
+        free(s);
         return NULL;
     }
-    return a;
+    s->func = func;
+    s->done = done;
+    s->arg = arg;
+    s->budget = config_get_walk_budget_usec() / 1E6;
+    beacon_cursor_open(&s->cursor);
+    struct timeval tv = {0, 0};
+    evtimer_add(s->ev, &tv);
+    return s;
+}
+
+void beacon_walk_cancel(beacon_slicer_t *s)
+/* Stop a sliced walk without calling its done */
+{
+    beacon_cursor_close(&s->cursor);
+    event_free(s->ev);
+    free(s);
+}
+
+void beacon_touch(beacon_t *b)
+/* b was just heard, make it the last to be evicted */
+{
+    if (b != TAILQ_LAST(&beacon_lru, beacon_lru_list)) {
+        TAILQ_REMOVE(&beacon_lru, b, lru);
+        TAILQ_INSERT_TAIL(&beacon_lru, b, lru);
+    }
+}
+
+void beacon_mark_dirty(beacon_t *b)
+/* Queue b for the next report; it's a no-op if already queued */
+{
+    if (!b->dirty.tqe_prev) {
+        TAILQ_INSERT_TAIL(&beacon_dirty, b, dirty);
+    }
+}
+
+static void beacon_unlink_dirty(beacon_t *b) {
+    if (b->dirty.tqe_prev) {
+        TAILQ_REMOVE(&beacon_dirty, b, dirty);
+        b->dirty.tqe_prev = NULL;
+    }
+}
+
+void beacon_walk_dirty(beacon_walker_t func, void *arg)
+/* Call func on, and dequeue, every beacon marked dirty; the cost is in
+   proportion to the beacons heard, not the beacons tracked. Beacons
+   evicted while dirty are handed over as copies func must not remove */
+{
+    for (size_t i = 0; i < beacon_evicted_len; i++) {
+        func(&beacon_evicted[i], arg);
+    }
+    beacon_evicted_len = 0;
+    beacon_t *b;
+    while ((b = TAILQ_FIRST(&beacon_dirty))) {
+        beacon_unlink_dirty(b);
+        func(b, arg);
+    }
+}
+
+void beacon_remove(beacon_t *b)
+/* Stop tracking b and free it */
+{
+    beacon_unlink_dirty(b);
+    TAILQ_REMOVE(&beacon_lru, b, lru);
+    beacon_cursor_t *c;
+    TAILQ_FOREACH(c, &beacon_cursors, link) {
+        if (c->next == b) {
+            c->next = TAILQ_NEXT(b, all);
+        }
+    }
+    TAILQ_REMOVE(&beacon_all, b, all);
+    beacon_table_remove(&beacons, &b->key);
+    beacon_count[b->type]--;
+    wheel_del(&beacon_wheel, &b->expiry);
+    kalman_store_free(&beacon_filter_store, b->filter);
+    pool_free(&beacon_pool, b);
+}
+
+static void beacon_expire(wheel_timer_t *t, void *arg)
+/* A beacon's deadline came round; drop it unless it was heard since
+   it was armed */
+{
+    beacon_t *b = (beacon_t *)((uint8_t *)t - offsetof(beacon_t, expiry));
+    double now = *(double *)arg;
+    double last_seen = beacon_last_seen(b);
+    if (now - last_seen > MAX_BEACON_INACTIVE_SEC) {
+        log_debug("Beacon pruned\n");
+        beacon_remove(b);
+        beacon_stats.expired++;
+    } else {
+        beacon_arm(b, last_seen);
+    }
+}
+
+size_t beacon_gc(double now)
+/* Expire beacons gone quiet by now; the work is in proportion to the
+   beacons due, not the number tracked */
+{
+    if (!beacon_wheel_ready) {
+        return 0;
+    }
+    uint64_t before = beacon_stats.expired;
+    wheel_advance(&beacon_wheel, beacon_tick(now), beacon_expire, &now);
+    return beacon_stats.expired - before;
+}
+
+static void beacon_gc_cb(evutil_socket_t fd, short what, void *arg) {
+    UNUSED(fd);
+    UNUSED(what);
+    UNUSED(arg);
+    beacon_gc(time_now());
+}
+
+void beacon_gc_init(struct event_base *base)
+/* Expire beacons every GC_INTERVAL_SEC, whether or not reports are
+   going out */
+{
+    struct timeval tv = {GC_INTERVAL_SEC, 0};
+    beacon_gc_ev = event_new(base, -1, EV_PERSIST, beacon_gc_cb, NULL);
+    evtimer_add(beacon_gc_ev, &tv);
+}
+
+beacon_stats_t const *beacon_get_stats(void) {
+    beacon_stats.ibeacons = beacon_count[BEACON_IBEACON];
+    beacon_stats.sbeacons = beacon_count[BEACON_SECURE];
+    beacon_stats.uuids = uuid_index.used;
+    beacon_stats.slots = beacons.slots ? beacons.mask + 1 : 0;
+    beacon_stats.pool = beacon_pool.stats;
+    beacon_stats.allocs = beacon_table_allocs + beacon_pool.stats.slabs;
+    beacon_stats.frees = beacon_table_frees;
+
+    size_t tracked = beacon_count[BEACON_IBEACON] + beacon_count[BEACON_SECURE];
+    size_t capacity = beacon_max;
+    if (beacon_pool.cap) {
+        size_t fit = beacon_pool.cap / POOL_SLAB_SIZE * beacon_pool.per_slab;
+        if (!capacity || fit < capacity) {
+            capacity = fit;
+        }
+    }
+    beacon_stats.capacity = capacity;
+    beacon_stats.occupancy = capacity ? (double)tracked / capacity : 0;
+    beacon_t *oldest = TAILQ_FIRST(&beacon_lru);
+    beacon_stats.oldest_age =
+        oldest ? time_now() - beacon_last_seen(oldest) : 0;
+    return &beacon_stats;
+}
+
+kalman_store_t *beacon_filters(void)
+/* Where every beacon's Kalman filter lives, at slot b->filter */
+{
+    return &beacon_filter_store;
+}
+
+double beacon_last_seen(beacon_t const *b) {
+    return beacon_filter_store.slots[b->filter].last_seen;
+}
+
+uint8_t beacon_profile(beacon_t const *b)
+/* Index of b's Kalman filter profile in config_params()->kalman */
+{
+    config_params_t const *params = config_params();
+    if (params->generation != beacon_profile_generation) {
+        /* The profiles may have changed: resolve them afresh and start
+           the innovation statistics over for the ones now in force */
+        memset(beacon_uuid_profile, 0xff, sizeof(beacon_uuid_profile));
+        memset(beacon_filter_store.innovation, 0,
+               sizeof(beacon_filter_store.innovation));
+        beacon_profile_generation = params->generation;
+    }
+    if (b->type == BEACON_SECURE) {
+        return KALMAN_PROFILE_SECURE;
+    }
+    uint16_t const u = IBEACON_KEY_UUID(b->key);
+    if (beacon_uuid_profile[u] == 0xff) {
+        beacon_uuid_profile[u] = KALMAN_PROFILE_IBEACON;
+        for (size_t i = KALMAN_PROFILE_UUID; i < params->kalman_profiles;
+             i++) {
+            if (!memcmp(params->kalman_uuid[i], beacon_uuid(u), 16)) {
+                beacon_uuid_profile[u] = i;
+                break;
+            }
+        }
+    }
+    return beacon_uuid_profile[u];
 }
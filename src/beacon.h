@@ -2,36 +2,120 @@
 #define __BEACON_H
 
 #include "kalman.h"
+#include "pool.h"
+#include "wheel.h"
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+
+#define BEACON_WHEEL_TICK_SEC 1.0 /* Expiry resolution */
 
 enum beacon_types { BEACON_IBEACON = 0, BEACON_SECURE };
 
-struct ibeacon_id {
-    uint8_t uuid[16];
-    uint16_t major, minor;
-    uint16_t count;
-};
+#define BEACON_UUID_MAX 1024 /* Distinct iBeacon UUIDs interned */
+#define BEACON_EVICT_FLUSH_MAX 128 /* Evicted beacons held for a report */
+#define BEACON_SLICE_CHECK 32 /* Beacons walked between clock reads */
+/* Fewest beacons max_beacons or beacon_memory_kb may cap the table
+   at; a batch of adverts in flight must not evict the beacons it is
+   about to update */
+#define BEACON_MAX_MIN (2 * KALMAN_BATCH_MAX)
+
+/* A beacon's identity as one word: secure beacons by their MAC (HCI
+   byte order, first byte lowest) under BEACON_KEY_SECURE, iBeacons by
+   interned UUID index, major and minor */
+typedef uint64_t beacon_key_t;
+
+#define BEACON_KEY_SECURE ((beacon_key_t)1 << 63)
+#define IBEACON_KEY(uuid_idx, major, minor)                                    \
+    ((beacon_key_t)(uint16_t)(uuid_idx) << 32 |                                \
+     (beacon_key_t)(uint16_t)(major) << 16 | (uint16_t)(minor))
+#define IBEACON_KEY_UUID(k) ((uint16_t)((k) >> 32))
+#define IBEACON_KEY_MAJOR(k) ((uint16_t)((k) >> 16))
+#define IBEACON_KEY_MINOR(k) ((uint16_t)(k))
+
+static inline beacon_key_t sbeacon_key(uint8_t const *mac) {
+    beacon_key_t k = 0;
+    for (int i = 5; i >= 0; i--) {
+        k = k << 8 | mac[i];
+    }
+    return k | BEACON_KEY_SECURE;
+}
 
-struct sbeacon_id {
-    uint8_t mac[6];
-};
+static inline void sbeacon_key_mac(beacon_key_t k, uint8_t *mac) {
+    for (int i = 0; i < 6; i++) {
+        mac[i] = k >> (8 * i);
+    }
+}
 
 typedef struct ibeacon {
-    hashable_filterable_t *next, *prev;
-    kalman_t kalman;
-    uint8_t type;
-    void *id;
+    uint32_t filter; /* Kalman filter slot in beacon_filters() */
+    uint32_t gated;  /* Measurements its filter took as outliers */
+    double distance, variance;
+    beacon_key_t key;
+    wheel_timer_t expiry;
+    TAILQ_ENTRY(ibeacon) dirty; /* Linked while count is unreported */
+    TAILQ_ENTRY(ibeacon) lru;   /* Least recently heard first */
+    TAILQ_ENTRY(ibeacon) all;   /* In the order added, for cursors */
+    uint64_t serial;            /* Position in that order */
     uint16_t count;
-    double last_seen, last_report, distance, variance;
+    uint8_t type;
     int8_t tx_power;
-    bool init;
 } beacon_t;
 
-uint32_t beacon_index(void *);
-bool beacon_eq(void *, void *);
-beacon_t *ibeacon_find_or_add(uint8_t const *const, uint16_t, uint16_t);
-beacon_t *sbeacon_find_or_add(uint8_t *);
-void *beacon_expire(void *, void *);
-void beacon_delete(void *);
+/* Called on every beacon by beacon_walk; returns NULL if it removed
+   the beacon */
+typedef beacon_t *(*beacon_walker_t)(beacon_t *, void *);
+
+/* Resumable position in the beacons; visits each beacon present when
+   it was opened and not removed before being reached exactly once.
+   Removing any beacon while a cursor is open is safe */
+typedef struct beacon_cursor {
+    beacon_t *next;
+    uint64_t end; /* Serial of the last beacon to visit */
+    TAILQ_ENTRY(beacon_cursor) link;
+} beacon_cursor_t;
+
+/* A walk spread over event loop turns by beacon_walk_sliced */
+typedef struct beacon_slicer beacon_slicer_t;
+
+typedef struct beacon_stats {
+    size_t ibeacons, sbeacons;
+    size_t uuids;
+    size_t slots;
+    uint64_t allocs; /* Heap allocations for beacon slabs and table slots */
+    uint64_t frees;
+    pool_stats_t pool;
+    uint64_t expired;
+    size_t capacity;    /* Beacons the count and memory limits allow */
+    double occupancy;   /* Share of capacity tracked, 0 with no limit */
+    double oldest_age;  /* Seconds since the least recent beacon was heard */
+    uint64_t evicted;   /* Removed to make room for a new beacon */
+    uint64_t unflushed; /* Evicted with counts that missed their report */
+    uint64_t slices;    /* Event loop turns taken by sliced walks */
+} beacon_stats_t;
+
+int beacon_uuid_intern(uint8_t const *);
+uint8_t const *beacon_uuid(uint16_t);
+beacon_t *beacon_find(beacon_key_t);
+beacon_t *beacon_find_or_add(beacon_key_t);
+void beacon_cursor_open(beacon_cursor_t *);
+beacon_t *beacon_cursor_next(beacon_cursor_t *);
+void beacon_cursor_close(beacon_cursor_t *);
+void beacon_walk(beacon_walker_t, void *);
+beacon_slicer_t *beacon_walk_sliced(struct event_base *, beacon_walker_t,
+                                    void (*)(void *), void *);
+void beacon_walk_cancel(beacon_slicer_t *);
+void beacon_touch(beacon_t *);
+void beacon_mark_dirty(beacon_t *);
+void beacon_walk_dirty(beacon_walker_t, void *);
+void beacon_remove(beacon_t *);
+void beacon_gc_init(struct event_base *);
+size_t beacon_gc(double);
+beacon_stats_t const *beacon_get_stats(void);
+kalman_store_t *beacon_filters(void);
+double beacon_last_seen(beacon_t const *);
+uint8_t beacon_profile(beacon_t const *);
 
 #endif /* __BEACON_H */
@@ -0,0 +1,444 @@
+/* bench.c - Micro benchmarks of the per advert hot path
+ *
+ *   Run with --benchmark; results go to stdout. Each benchmark times
+ *   BENCH_SAMPLES calls over pseudo random but repeatable inputs that
+ *   are generated up front, so only the code under test is measured.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES() __rdtsc()
+#endif
+
+#include "beacon.h"
+#include "bench.h"
+#include "config.h"
+#include "distance.h"
+#include "kalman.h"
+#include "report.h"
+#include "time_util.h"
+
+typedef struct bench_distance_case {
+    double path_loss, haab;
+} bench_distance_case_t;
+
+static uint64_t bench_rng = 0x9e3779b97f4a7c15ULL;
+/* Results are summed here so the timed loops can't be optimized out */
+static volatile double bench_sink;
+
+static double bench_uniform(double min, double max)
+/* xorshift64*, scaled to [min, max) */
+{
+    bench_rng ^= bench_rng >> 12;
+    bench_rng ^= bench_rng << 25;
+    bench_rng ^= bench_rng >> 27;
+    uint64_t r = bench_rng * 0x2545f4914f6cdd1dULL;
+    return min + (max - min) * ((r >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static void bench_distance_one(bench_distance_case_t const *c, int8_t *tx,
+                               double *rssi, double *p) {
+    double t, sink = 0, err_d = 0, err_v = 0;
+    double ns_exact, ns_lut;
+
+    distance_update(c->path_loss, c->haab);
+
+    t = time_monotonic();
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        double d, v;
+        distance_estimate_exact(tx[i], rssi[i], p[i], c->path_loss, c->haab,
+                                &d, &v);
+        sink += d + v;
+    }
+    ns_exact = (time_monotonic() - t) * 1E9 / BENCH_SAMPLES;
+
+    t = time_monotonic();
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        double d, v;
+        distance_estimate(tx[i], rssi[i], p[i], &d, &v);
+        sink += d + v;
+    }
+    ns_lut = (time_monotonic() - t) * 1E9 / BENCH_SAMPLES;
+    bench_sink = sink;
+
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        double de, ve, dl, vl;
+        distance_estimate_exact(tx[i], rssi[i], p[i], c->path_loss, c->haab,
+                                &de, &ve);
+        distance_estimate(tx[i], rssi[i], p[i], &dl, &vl);
+        /* Relative, or absolute below 1m as the tables are built */
+        err_d = fmax(err_d, fabs(dl - de) / fmax(de, 1.0));
+        err_v = fmax(err_v, ve > 0 ? fabs(vl - ve) / ve : 0);
+    }
+
+    distance_stats_t const *ds = distance_get_stats();
+    printf("distance  path_loss %.1f haab %.1f  %4zu entries  "
+           "exact %6.1fns  table %6.1fns  x%.1f  max err dist %.2e "
+           "var %.2e\n",
+           c->path_loss, c->haab, ds->entries, ns_exact, ns_lut,
+           ns_exact / ns_lut, err_d, err_v);
+}
+
+static void bench_distance(void) {
+    bench_distance_case_t const cases[] = {
+        {config_get_path_loss(), config_get_haab()}, {2.0, 0}, {3.2, 1.5}};
+    int8_t *tx = malloc(BENCH_SAMPLES * sizeof(int8_t));
+    double *rssi = malloc(BENCH_SAMPLES * sizeof(double));
+    double *p = malloc(BENCH_SAMPLES * sizeof(double));
+    if (!tx || !rssi || !p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    /* What the Kalman filter hands over in the field */
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        tx[i] = lround(bench_uniform(-75, -50));
+        rssi[i] = bench_uniform(-105, -30);
+        p[i] = bench_uniform(0.05, 4);
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bench_distance_one(&cases[i], tx, rssi, p);
+    }
+    free(tx);
+    free(rssi);
+    free(p);
+    distance_update(config_get_path_loss(), config_get_haab());
+}
+
+static double bench_gauss(void) {
+    double u = 1.0 - bench_uniform(0, 1);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * bench_uniform(0, 1));
+}
+
+static void bench_kalman_trace(int8_t *z, double *ts, size_t n)
+/* A tag wandering 0.5-30m from the antenna, advertising every second
+   with the odd advert lost and now and then a longer gap */
+{
+    double d = bench_uniform(0.5, 30), t = 0;
+    for (size_t i = 0; i < n; i++) {
+        t += 1 + bench_uniform(0, 0.01);
+        if (bench_uniform(0, 1) < 0.1) {
+            t += 1;
+        }
+        if (bench_uniform(0, 1) < 0.005) {
+            t += bench_uniform(2, 9);
+        }
+        d = fmin(fmax(d + 0.7 * bench_gauss(), 0.5), 30);
+        double rssi = -59 - 10 * config_get_path_loss() * log10(d) +
+                      4 * bench_gauss();
+        z[i] = lround(fmin(fmax(rssi, -127), 0));
+        ts[i] = t;
+    }
+}
+
+static void bench_kalman(void)
+/* The fixed point filter against the double one over the same traces:
+   how far apart they end up, and what an update costs */
+{
+    size_t const len = BENCH_SAMPLES / BENCH_KALMAN_TRACES;
+    int8_t const tx = -59;
+    int8_t *z = malloc(BENCH_SAMPLES * sizeof(int8_t));
+    double *ts = malloc(BENCH_SAMPLES * sizeof(double));
+    if (!z || !ts) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    for (size_t i = 0; i < BENCH_KALMAN_TRACES; i++) {
+        bench_kalman_trace(z + i * len, ts + i * len, len);
+    }
+
+    kalman_profile_t const prof = KALMAN_PROFILE_DEFAULT;
+    double err_rssi = 0, err_var = 0, err_dist = 0, pl = config_get_path_loss(),
+           haab = config_get_haab();
+    for (size_t i = 0; i < BENCH_KALMAN_TRACES; i++) {
+        kalman_t f = {.init = false};
+        kalman_fixed_t x = {.init = false};
+        for (size_t j = i * len; j < (i + 1) * len; j++) {
+            double rf = kalman(&f, &prof, z[j], ts[j]);
+            double rx = kalman_fixed(&x, &prof, z[j], ts[j]);
+            double df, vf, dx, vx;
+            distance_estimate_exact(tx, rf, f.P[0][0], pl, haab, &df, &vf);
+            distance_estimate_exact(tx, rx, Q16_TO_DOUBLE(x.P[0][0]), pl,
+                                    haab, &dx, &vx);
+            err_rssi = fmax(err_rssi, fabs(rx - rf));
+            err_var = fmax(err_var, fabs(Q16_TO_DOUBLE(x.P[0][0]) - f.P[0][0]));
+            err_dist = fmax(err_dist, fabs(dx - df));
+        }
+    }
+
+    double ns[2], cycles[2] = {0, 0}, sink = 0;
+    for (int fixed = 0; fixed < 2; fixed++) {
+#ifdef BENCH_CYCLES
+        uint64_t c = BENCH_CYCLES();
+#endif
+        double t = time_monotonic();
+        for (size_t i = 0; i < BENCH_KALMAN_TRACES; i++) {
+            kalman_t f = {.init = false};
+            kalman_fixed_t x = {.init = false};
+            for (size_t j = i * len; j < (i + 1) * len; j++) {
+                sink += fixed ? kalman_fixed(&x, &prof, z[j], ts[j])
+                              : kalman(&f, &prof, z[j], ts[j]);
+            }
+        }
+        ns[fixed] = (time_monotonic() - t) * 1E9 / BENCH_SAMPLES;
+#ifdef BENCH_CYCLES
+        cycles[fixed] = (double)(BENCH_CYCLES() - c) / BENCH_SAMPLES;
+#endif
+    }
+    bench_sink = sink;
+
+    printf("kalman    double %5.1fns %5.0f cycles  fixed %5.1fns %5.0f cycles  "
+           "max err rssi %.2edB var %.2e dist %.2em\n",
+           ns[0], cycles[0], ns[1], cycles[1], err_rssi, err_var, err_dist);
+    free(z);
+    free(ts);
+}
+
+/* kalman_batch is checked against the scalar filter of its flavour */
+#ifdef KALMAN_FIXED
+typedef kalman_fixed_t bench_filter_t;
+#define bench_filter kalman_fixed
+#define BENCH_FILTER_DOUBLE(x) Q16_TO_DOUBLE(x)
+#else
+typedef kalman_t bench_filter_t;
+#define bench_filter kalman
+#define BENCH_FILTER_DOUBLE(x) (x)
+#endif
+
+static bool bench_kalman_batch_one(size_t n, uint32_t const *idx,
+                                   int8_t const *z)
+/* Updates/s of n beacon filters, one kalman() per advert on filters
+   scattered through memory against kalman_batch over a store. Even
+   filters down weight outliers, odd ones estimate R as they go and
+   drop outliers. Returns false unless both end up bit for bit the
+   same */
+{
+    kalman_profile_t prof[2] = {KALMAN_PROFILE_DEFAULT,
+                                KALMAN_PROFILE_DEFAULT};
+    prof[0].gate = prof[1].gate = 3;
+    prof[1].alpha = 1.0 / KALMAN_ADAPTIVE_WINDOW;
+    prof[1].gate_drop = true;
+    bench_filter_t *f = calloc(n, sizeof(bench_filter_t));
+    kalman_store_t s = {0};
+    uint32_t slot[KALMAN_BATCH_MAX];
+    uint8_t profile[KALMAN_BATCH_MAX];
+    int8_t bz[KALMAN_BATCH_MAX];
+    double bts[KALMAN_BATCH_MAX], rssi[KALMAN_BATCH_MAX], var[KALMAN_BATCH_MAX];
+    bool gated[KALMAN_BATCH_MAX];
+    double sink = 0, t;
+    if (!f) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (kalman_store_alloc(&s) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(ENOMEM);
+        }
+    }
+
+    /* 10k adverts/s, so the filters see a spread of dt */
+    t = time_monotonic();
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        size_t const k = idx[i] % n;
+        sink += bench_filter(&f[k], &prof[k & 1], z[i], i * 1E-4);
+    }
+    double ups_scalar = BENCH_SAMPLES / (time_monotonic() - t);
+
+    t = time_monotonic();
+    for (size_t i = 0; i < BENCH_SAMPLES; i += KALMAN_BATCH_MAX) {
+        size_t m = BENCH_SAMPLES - i < KALMAN_BATCH_MAX ? BENCH_SAMPLES - i
+                                                         : KALMAN_BATCH_MAX;
+        for (size_t j = 0; j < m; j++) {
+            slot[j] = idx[i + j] % n;
+            profile[j] = slot[j] & 1;
+            bz[j] = z[i + j];
+            bts[j] = (i + j) * 1E-4;
+        }
+        kalman_batch(&s, prof, slot, profile, bz, bts, rssi, var, gated, m);
+        sink += rssi[0];
+    }
+    double ups_batch = BENCH_SAMPLES / (time_monotonic() - t);
+    bench_sink = sink;
+
+    size_t diff = 0;
+    for (size_t i = 0; i < n; i++) {
+        kalman_t k, r = {.init = f[i].init,
+                         .nu2 = BENCH_FILTER_DOUBLE(f[i].nu2),
+                         .last_seen = f[i].last_seen};
+        kalman_store_get(&s, i, &k);
+        for (int a = 0; a < 2; a++) {
+            r.state[a] = BENCH_FILTER_DOUBLE(f[i].state[a]);
+            r.P[a][0] = BENCH_FILTER_DOUBLE(f[i].P[a][0]);
+            r.P[a][1] = BENCH_FILTER_DOUBLE(f[i].P[a][1]);
+        }
+        if (memcmp(k.state, r.state, sizeof(k.state)) ||
+            memcmp(k.P, r.P, sizeof(k.P)) || k.nu2 != r.nu2 ||
+            k.outliers != f[i].outliers ||
+            k.last_seen != r.last_seen || k.init != r.init) {
+            diff++;
+        }
+    }
+    printf("kalman    %6zu beacons  scalar %6.1fM updates/s  batch %6.1fM "
+           "updates/s  x%.2f  %zu filters differ\n",
+           n, ups_scalar / 1E6, ups_batch / 1E6, ups_batch / ups_scalar, diff);
+    free(f);
+    kalman_store_destroy(&s);
+    return diff == 0;
+}
+
+static int bench_kalman_batch(void) {
+    size_t const sizes[] = {1000, 100000};
+    int ret = 0;
+    uint32_t *idx = malloc(BENCH_SAMPLES * sizeof(uint32_t));
+    int8_t *z = malloc(BENCH_SAMPLES * sizeof(int8_t));
+    if (!idx || !z) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        idx[i] = bench_uniform(0, UINT32_MAX);
+        z[i] = lround(bench_uniform(-100, -40));
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (!bench_kalman_batch_one(sizes[i], idx, z)) {
+            fprintf(stderr, "Batched Kalman updates differ from kalman()\n");
+            ret = -1;
+        }
+    }
+    free(idx);
+    free(z);
+    return ret;
+}
+
+static beacon_t *bench_beacon_remove(beacon_t *b, void *arg) {
+    UNUSED(arg);
+    beacon_remove(b);
+    return NULL;
+}
+
+static bool bench_beacons_one(size_t n, uint32_t const *idx)
+/* Fill the table with n beacons, then look them up as adverts would.
+   Returns false if a lookup of a known beacon touched the heap */
+{
+    static uint8_t const uuid[16] = {0xc3, 0x11, 0x57, 0xe1};
+    int u = beacon_uuid_intern(uuid);
+    double t, ns_insert, ns_lookup;
+    uintptr_t sink = 0;
+
+    t = time_monotonic();
+    for (size_t i = 0; i < n; i++) {
+        sink += (uintptr_t)beacon_find_or_add(IBEACON_KEY(u, i >> 16, i));
+    }
+    ns_insert = (time_monotonic() - t) * 1E9 / n;
+
+    beacon_stats_t const *bs = beacon_get_stats();
+    uint64_t allocs = bs->allocs;
+    t = time_monotonic();
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        uint32_t j = idx[i] % n;
+        sink += (uintptr_t)beacon_find_or_add(IBEACON_KEY(u, j >> 16, j));
+    }
+    ns_lookup = (time_monotonic() - t) * 1E9 / BENCH_SAMPLES;
+    bench_sink = sink;
+    allocs = beacon_get_stats()->allocs - allocs;
+
+    printf("beacons   %6zu tracked  %6zu slots  %5zukB pool  insert %6.1fns  "
+           "lookup %6.1fns  %" PRIu64 " allocs in lookups\n",
+           bs->ibeacons, bs->slots, bs->pool.bytes / 1024, ns_insert,
+           ns_lookup, allocs);
+    beacon_walk(bench_beacon_remove, NULL);
+    return allocs == 0;
+}
+
+static int bench_beacons(void) {
+    size_t const sizes[] = {100, 10000, 100000};
+    int ret = 0;
+    uint32_t *idx = malloc(BENCH_SAMPLES * sizeof(uint32_t));
+    if (!idx) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    /* Adverts arrive in no particular order */
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        idx[i] = bench_uniform(0, UINT32_MAX);
+    }
+    /* Every new beacon is logged; keep that out of the timing */
+    int mask = setlogmask(LOG_UPTO(LOG_WARNING));
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (!bench_beacons_one(sizes[i], idx)) {
+            fprintf(stderr, "Beacon lookups allocated memory\n");
+            ret = -1;
+        }
+    }
+    setlogmask(mask);
+    free(idx);
+    return ret;
+}
+
+static beacon_t *bench_beacon_nop(beacon_t *b, void *arg) {
+    UNUSED(arg);
+    return b;
+}
+
+static void bench_report(void)
+/* A site of parked tags with a few on the move: a report only has the
+   active ones to encode */
+{
+    size_t const tracked = 10000, active = 100, reports = 1000;
+    static uint8_t const uuid[16] = {0xc3, 0x11, 0x57, 0xe1};
+    int u = beacon_uuid_intern(uuid);
+    beacon_t **b = malloc(tracked * sizeof(beacon_t *));
+    if (!b) {
+        fprintf(stderr, "Out of memory\n");
+        exit(ENOMEM);
+    }
+    int mask = setlogmask(LOG_UPTO(LOG_WARNING));
+    for (size_t i = 0; i < tracked; i++) {
+        b[i] = beacon_find_or_add(IBEACON_KEY(u, i >> 16, i));
+    }
+
+    double t = time_monotonic();
+    for (size_t r = 0; r < reports; r++) {
+        beacon_walk(bench_beacon_nop, NULL);
+    }
+    double us_walk = (time_monotonic() - t) * 1E6 / reports;
+
+    t = time_monotonic();
+    for (size_t r = 0; r < reports; r++) {
+        for (size_t i = 0; i < active; i++) {
+            beacon_t *a = b[(r * active + i) * 7919 % tracked];
+            a->count++;
+            beacon_mark_dirty(a);
+        }
+        report_cb(-1, 0, NULL);
+    }
+    double us_report = (time_monotonic() - t) * 1E6 / reports;
+
+    printf("report    %6zu tracked  %6zu active  report %6.1fus  "
+           "(walking every beacon alone %6.1fus, %zu slots)\n",
+           tracked, active, us_report, us_walk, beacon_get_stats()->slots);
+    beacon_walk(bench_beacon_remove, NULL);
+    setlogmask(mask);
+    free(b);
+}
+
+int bench_run(void) {
+    bench_distance();
+    bench_kalman();
+    int ret = bench_kalman_batch();
+    if (bench_beacons() < 0) {
+        ret = -1;
+    }
+    bench_report();
+    return ret;
+}
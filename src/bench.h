@@ -0,0 +1,6 @@
+#pragma once
+
+#define BENCH_SAMPLES 1000000 /* Inputs timed per benchmark */
+#define BENCH_KALMAN_TRACES 1000 /* Tags the Kalman samples are split over */
+
+int bench_run(void);
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <math.h>
 #include <poll.h>
 #include <signal.h>
@@ -20,10 +21,12 @@
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 
+#include "accept_list.h"
+#include "admission.h"
 #include "beacon.h"
 #include "ble.h"
 #include "config.h"
-#include "hash.h"
+#include "distance.h"
 #include "kalman.h"
 #include "log.h"
 #include "report.h"
@@ -36,8 +39,6 @@
 #define _(string) string
 #endif /* HAVE_GETTEXT */
 
-extern int dd;
-
 char *hexlify(const uint8_t *src, size_t n) {
     char *buf = calloc(1, n * 2 + 1);
     for (size_t i = 0; i < n; i++) {
@@ -46,56 +47,180 @@ char *hexlify(const uint8_t *src, size_t n) {
     return buf;
 }
 
-static ble_report_t *ble_get_report(uint8_t const *const buf,
-                                    ble_report_hdr_t const *const hdr,
-                                    uint8_t idx)
-/* Deinterlace raw hci_evt buffer into structured reports or NULL on
-   error*/
+static bool ble_get_report(uint8_t const *const buf,
+                           ble_report_hdr_t const *const hdr, uint8_t idx,
+                           ble_report_t *rpt)
+/* Deinterlace raw hci_evt buffer into a report view pointing into
+   buf. Returns false if the report doesn't fit inside the event */
 {
-    ble_report_t *rpt = NULL;
-    uint8_t const *p = buf + 2 + idx;
-    if (!(rpt = calloc(1, sizeof(ble_report_t)))) {
-        log_error("Failed to allocate memory");
-        return NULL;
-    }
+    uint8_t const n = hdr->num_reports;
     /* Archane pointer arithmatic. Bluetooth HCI requires brain
        damage; what possible reason could there be for interleaving
        the reports */
-    rpt->evt_type = *p;
-    p += hdr->num_reports;
-    rpt->addr_type = *p;
-    p += hdr->num_reports - idx + (idx * 6);
-    memcpy(rpt->addr, p, 6);
-    /* Move pointer to Length_Data[0] */
-    p += (hdr->num_reports - idx) * 6;
-    for (uint8_t i = 0, offset = 0; i < hdr->num_reports; i++) {
-        if (i == idx) {
-            rpt->data_len = *(p + i);
-            /* Point p at the offset of this report's data */
-            p += offset + hdr->num_reports;
-            break;
+    uint8_t const *len = buf + 2 + 8 * n;
+    size_t offset = 2 + 9 * n;
+    size_t const data_end = hdr->param_len - n;
+
+    rpt->evt_type = buf[2 + idx];
+    rpt->addr_type = buf[2 + n + idx];
+    rpt->addr = buf + 2 + 2 * n + idx * 6;
+    for (uint8_t i = 0; i < idx; i++) {
+        offset += len[i];
+    }
+    rpt->data_len = len[idx];
+    if (offset + rpt->data_len > data_end) {
+        return false;
+    }
+    rpt->data = buf + offset;
+    rpt->rssi = (int8_t)buf[data_end + idx];
+    rpt->tx_power = BLE_EXT_TX_POWER_UNAVAILABLE;
+    return true;
+}
+
+static ble_adapter_t ble_adapters[BLE_MAX_ADAPTERS];
+static size_t ble_adapter_num = 0;
+static ble_filter_stats_t ble_filter_stats = {0};
+
+static int ble_le_cmd(int dd, uint16_t ocf, void *cp, int clen)
+/* Send an LE controller command, returns the HCI status or -1 if the
+   controller didn't answer */
+{
+    uint8_t status = 0;
+    struct hci_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = ocf;
+    rq.cparam = cp;
+    rq.clen = clen;
+    rq.rparam = &status;
+    rq.rlen = 1;
+    if (hci_send_req(dd, &rq, 1000) < 0) {
+        return -1;
+    }
+    return status;
+}
+
+static int ble_ext_scan_enable(int dd, uint8_t enable, uint8_t filter_dup) {
+    uint8_t cp[] = {enable, filter_dup, 0, 0, 0, 0}; /* No duration/period */
+    return ble_le_cmd(dd, BLE_OCF_SET_EXT_SCAN_ENABLE, cp, sizeof(cp));
+}
+
+static bool ble_ext_scan_start(ble_adapter_t const *const a, int dd)
+/* Program extended scanning on every configured PHY, returns false if
+   the controller refuses so the caller can fall back to legacy
+   scanning */
+{
+    ble_scan_params_t const *const scan = &a->scan;
+    /* Default LE event mask plus LE Extended Advertising Report */
+    le_set_event_mask_cp mask = {{0x1f, 0x10, 0, 0, 0, 0, 0, 0}};
+    if (ble_le_cmd(dd, OCF_LE_SET_EVENT_MASK, &mask, sizeof(mask))) {
+        return false;
+    }
+
+    uint8_t phys = config_get_scan_phys();
+    uint8_t cp[3 + 2 * 5] = {scan->own_type, scan->filter_policy, phys};
+    int clen = 3;
+    for (uint8_t phy = BLE_SCAN_PHY_1M; phy <= BLE_SCAN_PHY_CODED; phy <<= 1) {
+        if (phys & phy) {
+            /* One scan type/interval/window triple per PHY */
+            cp[clen++] = scan->scan_type;
+            cp[clen++] = scan->interval & 0xff;
+            cp[clen++] = scan->interval >> 8;
+            cp[clen++] = scan->window & 0xff;
+            cp[clen++] = scan->window >> 8;
         }
-        offset += *(p + i);
     }
-    rpt->data = p;
-    rpt->rssi = (int8_t) * (buf + hdr->param_len - hdr->num_reports + idx);
-    return rpt;
+    if (ble_le_cmd(dd, BLE_OCF_SET_EXT_SCAN_PARAMETERS, cp, clen)) {
+        return false;
+    }
+    if (ble_ext_scan_enable(dd, 0x01, scan->filter_dup)) {
+        return false;
+    }
+    return true;
 }
 
-int ble_init(int dev_id) {
-    /* Always happens in parent running as root */
-    int ctl, err, dd;
-    uint8_t own_type = 0x00;
-    uint8_t scan_type = 0x01;
-    uint8_t filter_policy = 0x00;
-    uint16_t interval = htobs(0x0064);
-    uint16_t window = htobs(0x0064);
+static int ble_scan_start(ble_adapter_t const *const a, int dd)
+/* (Re)start scanning with the adapter's current scan parameters */
+{
+    ble_scan_params_t const *const scan = &a->scan;
+    if (scan->extended) {
+        return ble_ext_scan_start(a, dd) ? 0 : -1;
+    }
+    if (hci_le_set_scan_parameters(dd, scan->scan_type, htobs(scan->interval),
+                                   htobs(scan->window), scan->own_type,
+                                   scan->filter_policy, 1000) < 0) {
+        log_error(_("Set scan parameters failed on hci%d: %s"), a->dev_id,
+                  strerror(errno));
+        return -1;
+    }
+    if (hci_le_set_scan_enable(dd, 0x1, scan->filter_dup, 1000) < 0) {
+        log_error(_("Enable scan failed on hci%d: %s"), a->dev_id,
+                  strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int ble_scan_disable(ble_adapter_t const *const a, int dd) {
+    if (a->scan.extended) {
+        return ble_ext_scan_enable(dd, 0x00, 0x00) ? -1 : 0;
+    }
+    return hci_le_set_scan_enable(dd, 0x00, 0x00, 1000);
+}
+
+size_t ble_adapter_count(void) {
+    return ble_adapter_num;
+}
+
+ble_adapter_t const *ble_get_adapter(size_t idx) {
+    return idx < ble_adapter_num ? &ble_adapters[idx] : NULL;
+}
+
+ble_filter_stats_t const *ble_get_filter_stats(void) {
+    return &ble_filter_stats;
+}
+
+void ble_log_filter_stats(void)
+/* How steady filtered distances were, for replay and simulation runs
+   to compare filter settings by */
+{
+    ble_filter_stats_t const *fs = &ble_filter_stats;
+    double const steps = fs->steps ? fs->steps : 1;
+    log_notice("Filtered %" PRIu64 " adverts, %" PRIu64
+               " gated: distance steps %.3fm mean, %.3fm rms, %" PRIu64
+               " over %.1fm",
+               fs->updates, fs->gated, fs->step_sum / steps,
+               sqrt(fs->step_sq / steps), fs->jumps, BLE_DISTANCE_JUMP_M);
+}
+
+int ble_scan_pause(void)
+/* Scan parameters and the filter accept list can't change while
+   scanning; pause every adapter, make changes on the command sockets
+   then resume. Needs CAP_NET_RAW, so only the parent calls these */
+{
+    int rv = 0;
+    for (size_t i = 0; i < ble_adapter_num; i++) {
+        if (ble_scan_disable(&ble_adapters[i], ble_adapters[i].cmd_dd) < 0) {
+            rv = -1;
+        }
+    }
+    return rv;
+}
 
-    if (dev_id < 0) {
-        log_warn("Bluetooth interface invalid or not specified, trying first "
-                 "interface\n");
-        dev_id = hci_get_route(NULL);
+int ble_scan_resume(uint8_t filter_policy) {
+    int rv = 0;
+    for (size_t i = 0; i < ble_adapter_num; i++) {
+        ble_adapters[i].scan.filter_policy = filter_policy;
+        if (ble_scan_start(&ble_adapters[i], ble_adapters[i].cmd_dd) < 0) {
+            rv = -1;
+        }
     }
+    return rv;
+}
+
+static void ble_adapter_init(ble_adapter_t *a) {
+    /* Always happens in parent running as root */
+    int ctl, dd;
 
     /* Get a control socket so we can bring the interface up, if needed */
     if ((ctl = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI)) < 0) {
@@ -103,33 +228,40 @@ int ble_init(int dev_id) {
         exit(errno);
     }
 
-    if (ioctl(ctl, HCIDEVUP, dev_id) < 0) {
+    if (ioctl(ctl, HCIDEVUP, a->dev_id) < 0) {
         if (errno != EALREADY) {
             log_error("Could not open bluetooth device", strerror(errno));
             exit(errno);
         } else {
-            log_notice("Using interface hci%d\n", dev_id);
+            log_notice("Using interface hci%d\n", a->dev_id);
         }
     } else {
-        log_notice("Brought up interface hci%d", dev_id);
+        log_notice("Brought up interface hci%d", a->dev_id);
     }
+    close(ctl);
 
-    if ((dd = hci_open_dev(dev_id)) < 0) {
+    /* The second socket is used to issue controller commands from
+       the parent without stealing events from the scan socket the
+       child reads. LE commands need CAP_NET_RAW, so the child can't
+       send them itself */
+    if ((a->dd = dd = hci_open_dev(a->dev_id)) < 0 ||
+        (a->cmd_dd = hci_open_dev(a->dev_id)) < 0) {
         log_error(_("Could not open bluetooth device"), strerror(errno));
         exit(errno);
     }
 
-    err = hci_le_set_scan_parameters(dd, scan_type, interval, window, own_type,
-                                     filter_policy, 1000);
-    if (err < 0) {
-        log_error(_("Set scan parameters failed"), strerror(errno));
-        exit(errno);
+    if (a->scan.extended) {
+        if (ble_ext_scan_start(a, dd)) {
+            log_notice("Extended scanning enabled on hci%d", a->dev_id);
+        } else {
+            log_warn("Extended scanning not supported by hci%d, falling "
+                     "back to legacy scanning",
+                     a->dev_id);
+            a->scan.extended = false;
+        }
     }
 
-    uint8_t filter_dup = 0;
-    err = hci_le_set_scan_enable(dd, 0x1, filter_dup, 1000);
-    if (err < 0) {
-        log_error(_("Enable scan failed"), strerror(errno));
+    if (!a->scan.extended && ble_scan_start(a, dd) < 0) {
         exit(errno);
     }
     struct hci_filter nf, of;
@@ -150,148 +282,506 @@ int ble_init(int dev_id) {
         raise(SIGTERM);
         exit(errno);
     }
-    return dd;
+
+    /* Have the kernel stamp each event as it arrives, so filters see
+       the true spacing of adverts however late the loop reads them */
+    int one = 1;
+    if (setsockopt(dd, SOL_HCI, HCI_TIME_STAMP, &one, sizeof(one)) < 0) {
+        log_warn("No kernel timestamps on hci%d, stamping events when "
+                 "read: %s",
+                 a->dev_id, strerror(errno));
+    }
+    evutil_make_socket_nonblocking(dd);
 }
 
-void ble_readcb(struct bufferevent *bev, void *ptr) {
-    UNUSED(ptr);
-    int n = -1;
-    double ts = time_now();
-    ble_report_hdr_t hdr_buf;
+static size_t ble_load_adapters(bool open)
+/* Fill the adapter table from the config, opening and starting scans
+   on them if requested */
+{
+    c3_adapter_config_t cfgs[BLE_MAX_ADAPTERS];
+    size_t n = config_get_adapters(cfgs, BLE_MAX_ADAPTERS);
+    bool extended = config_get_scan_extended();
 
-    struct evbuffer *input = bufferevent_get_input(bev);
-    while (evbuffer_get_length(input) >= sizeof(ble_report_hdr_t)) {
-        if ((n = evbuffer_copyout(input, &hdr_buf, sizeof(ble_report_hdr_t))) <
-            0) {
-            log_error("Failed to read from evbuffer");
-            return;
+    for (size_t i = 0; i < n; i++) {
+        ble_adapter_t *a = &ble_adapters[i];
+        memset(a, 0, sizeof(*a));
+        a->idx = i;
+        a->dev_id = cfgs[i].dev_id;
+        if (a->dev_id < 0) {
+            log_warn("Bluetooth interface invalid or not specified, trying "
+                     "first interface\n");
+            a->dev_id = open ? hci_get_route(NULL) : 0;
+        }
+        a->antenna_correction = cfgs[i].antenna_correction;
+        a->scan.own_type = 0x00;
+        a->scan.scan_type = 0x01;
+        a->scan.filter_policy = 0x00;
+        a->scan.filter_dup = 0x00;
+        a->scan.interval = cfgs[i].scan_interval;
+        a->scan.window = cfgs[i].scan_window;
+        a->scan.extended = extended;
+        a->dd = a->cmd_dd = -1;
+        ble_adapter_num = i + 1;
+        if (open) {
+            ble_adapter_init(a);
         }
+    }
+    return ble_adapter_num;
+}
 
-        /* By this point the ble_report_hdr is complete */
-        if (evbuffer_get_length(input) < (uint8_t)(hdr_buf.param_len + 2)) {
-            /* All the data hasn't arrived yet, set watermark and
-               retry later */
-            log_notice("Incomplete ble_report");
-            bufferevent_setwatermark(bev, EV_READ, hdr_buf.param_len + 2, 0);
-            return;
+size_t ble_init(void)
+/* Open and start scanning on every configured adapter */
+{
+    return ble_load_adapters(true);
+}
+
+size_t ble_init_offline(void)
+/* Configure the adapters without touching any hardware, for feeding
+   recorded traffic through ble_parse_batch */
+{
+    return ble_load_adapters(false);
+}
+
+void ble_cleanup(void)
+/* Stop scanning and close every adapter opened by ble_init */
+{
+    for (size_t i = 0; i < ble_adapter_num; i++) {
+        ble_adapter_t *a = &ble_adapters[i];
+        if (a->dd < 0) {
+            continue;
+        }
+        if (ble_scan_disable(a, a->dd) < 0) {
+            log_error("Disable scan failed on hci%d: %s", a->dev_id,
+                      strerror(errno));
+        } else {
+            log_notice("Scan disabled on hci%d\n", a->dev_id);
         }
+        if (hci_close_dev(a->dd) < 0 || hci_close_dev(a->cmd_dd) < 0) {
+            log_error("Closing HCI Socket Failed\n");
+        } else {
+            log_notice("HCI Socket Closed\n");
+        }
+        a->dd = a->cmd_dd = -1;
+    }
+}
 
-        /* The data has arrived, reset watermark in preparation
-           for the next packet */
-        bufferevent_setwatermark(bev, EV_READ, sizeof(ble_report_hdr_t), 0);
-        /* Drain the bytes not included in param_len field, that makes
-           it simpler to resolve rssi later on (without magic
-           numbers) */
-        evbuffer_drain(input, offsetof(ble_report_hdr_t, param_len) + 1);
-        uint8_t *body_buf = NULL;
-        if (!(body_buf = calloc(1, hdr_buf.param_len))) {
-            evbuffer_drain(input, hdr_buf.param_len);
-            log_error("Dropped ble report due to OOM");
+typedef struct ble_pending {
+    /* An advert waiting on the batched Kalman pass */
+    beacon_t *b;
+    int8_t tx_power;
+    uint8_t data_len;
+    uint8_t data[30]; /* Secure payload, reported once filtered */
+} ble_pending_t;
+
+/* Adverts queued for the next kalman_batch, and its inputs */
+static ble_pending_t ble_pending[KALMAN_BATCH_MAX];
+static uint32_t ble_pending_slot[KALMAN_BATCH_MAX];
+static uint8_t ble_pending_profile[KALMAN_BATCH_MAX];
+static int8_t ble_pending_z[KALMAN_BATCH_MAX];
+static double ble_pending_ts[KALMAN_BATCH_MAX];
+static size_t ble_pending_len = 0;
+
+static void ble_flush(void);
+
+static void ble_process_report(ble_report_t const *const rpt, double ts)
+/* Look up the beacon a single advertising report is from and queue
+   the report for filtering */
+{
+    if (rpt->addr_type != 1 || rpt->data_len < 29 || rpt->data_len > 30) {
+        /* Skip if this doesn't look like a report from a beacon */
+        return;
+    }
+#if 0
+    log_notice("HCI Event Type: %d", rpt->evt_type);
+    log_notice("HCI Addr Type: %d", rpt->addr_type);
+    log_notice("MAC: %s", hexlify(rpt->addr, 6));
+    log_notice("Len: %d\n", rpt->data_len);
+    log_notice("Packet: %s", hexlify(rpt->data, rpt->data_len));
+#endif
+
+    /* Parse data from HCI Event Report */
+    int8_t tx_power;
+    beacon_t *b;
+    if (rpt->data_len == 30) {
+        /* Secure packet */
+        if (!accept_list_admit(rpt->addr, NULL, ts)) {
             return;
         }
-        if (evbuffer_remove(input, body_buf, hdr_buf.param_len) < 0) {
-            log_error("Failed to read evbuffer, ble report dropped");
-            evbuffer_drain(input, hdr_buf.param_len);
-            free(body_buf);
+        beacon_key_t key = sbeacon_key(rpt->addr);
+        if (!(b = beacon_find(key))) {
+            /* Addresses we don't know serve probation first */
+            if (!admission_admit(key, ts)) {
+                return;
+            }
+            b = beacon_find_or_add(key);
+        }
+        tx_power = rpt->data[BLE_SECURE_TX_POWER];
+    } else {
+        /* A 29 byte iBeacon payload ends with the minor and carries no
+           measured power. Extended reports give the advertiser's
+           transmit power, which is taken down to its 1m RSSI */
+        uint8_t const *uuid = rpt->data + 9;
+        tx_power = BLE_TX_POWER_DEFAULT;
+        if (rpt->tx_power != BLE_EXT_TX_POWER_UNAVAILABLE) {
+            tx_power = rpt->tx_power - BLE_PATH_LOSS_1M;
+        }
+        if (!accept_list_admit(rpt->addr, uuid, ts)) {
             return;
         }
 
-        for (uint8_t i = 0; i < hdr_buf.num_reports; i++) {
-            ble_report_t *rpt = NULL;
-            if (!(rpt = ble_get_report(body_buf, &hdr_buf, i))) {
-                continue;
-            }
+        /* Lookup beacon by its one word key, nothing is allocated
+           unless it is new */
+        int uuid_idx = beacon_uuid_intern(uuid);
+        if (uuid_idx < 0) {
+            return;
+        }
+        uint16_t major = rpt->data[25] << 8 | rpt->data[26];
+        uint16_t minor = rpt->data[27] << 8 | rpt->data[28];
+        b = beacon_find_or_add(IBEACON_KEY(uuid_idx, major, minor));
+    }
+    if (!b) {
+        return;
+    }
+    /* Derive / Correct Values */
+    int correction = ble_adapters[rpt->adapter].antenna_correction;
+    if (correction == CONFIG_ANTENNA_CORRECTION_GLOBAL) {
+        correction = config_params()->antenna_correction;
+    }
 
-            if (rpt->addr_type != 1 || rpt->data_len < 29 ||
-                rpt->data_len > 30) {
-                /* Skip if this doesn't look like a report from a beacon */
-                goto skip;
-            }
-#if 1
-            log_notice("HCI Num Report: %d/%d", i + 1, hdr_buf.num_reports);
-            log_notice("HCI Event Type: %d", rpt->evt_type);
-            log_notice("HCI Addr Type: %d", rpt->addr_type);
-            log_notice("MAC: %s", hexlify(rpt->addr, 6));
-            log_notice("Len: %d\n", rpt->data_len);
-            log_notice("Packet: %s", hexlify(rpt->data, rpt->data_len));
-#endif
+    /* Queue for the batched Kalman pass. The beacon goes to the back
+       of the eviction order now, so no advert queued after it can
+       evict it before the queue is flushed */
+    beacon_touch(b);
+    ble_pending_t *p = &ble_pending[ble_pending_len];
+    p->b = b;
+    p->tx_power = tx_power;
+    p->data_len = rpt->data_len;
+    if (b->type == BEACON_SECURE) {
+        memcpy(p->data, rpt->data, rpt->data_len);
+    }
+    ble_pending_slot[ble_pending_len] = b->filter;
+    ble_pending_profile[ble_pending_len] = beacon_profile(b);
+    ble_pending_z[ble_pending_len] = rpt->rssi + correction;
+    ble_pending_ts[ble_pending_len] = ts;
+    if (++ble_pending_len == KALMAN_BATCH_MAX) {
+        ble_flush();
+    }
+}
 
-            /* Parse data from HCI Event Report */
-            int8_t tx_power;
-            beacon_t *b;
-            if (rpt->data_len == 30) {
-                /* Secure packet */
-                b = sbeacon_find_or_add(rpt->addr);
-                tx_power = rpt->data[30];
-            } else {
-                uint8_t const *uuid = rpt->data + 9;
-                tx_power = rpt->data[29];
-                uint16_t major = rpt->data[25] << 8 | rpt->data[26];
-                uint16_t minor = rpt->data[27] << 8 | rpt->data[28];
-
-                /* Lookup beacon */
-                b = ibeacon_find_or_add(uuid, major, minor);
-            }
-            /* Derive / Correct Values */
-            int8_t cor_rssi = rpt->rssi + config_get_antenna_correction();
-            double flt_rssi = kalman(b, cor_rssi, ts);
-
-            /* Filter Distance Data */
-            double flt_dist =
-                pow(10, (tx_power - flt_rssi) / (10 * config_get_path_loss()));
-
-            /* Correct for HAAB truncating data below 0m */
-            b->distance = sqrt(pow(flt_dist, 2) - pow(config_get_haab(), 2));
-            if (isnan(b->distance)) {
-                b->distance = 0;
-            }
+static void ble_finish(ble_pending_t const *p, int8_t cor_rssi,
+                       double flt_rssi, double flt_var, bool gated)
+/* The rest of the pipeline for one advert, once it's been filtered */
+{
+    beacon_t *b = p->b;
+    int8_t tx_power = p->tx_power;
+    double const prev = b->distance, prev_var = b->variance;
 
-            b->tx_power = (b->count * b->tx_power + tx_power) / (b->count + 1);
-            b->count++;
+    /* Filter Distance Data, corrected for HAAB truncating data below
+       0m. Variance is converted to meters from RSSI units, linearized
+       near the current estimate */
+    distance_estimate(tx_power, flt_rssi, flt_var, &b->distance,
+                      &b->variance);
 
-            /* Convert variance to meters from RSSI units linearize near
-               current estimate */
-            double stddev =
-                sqrt(b->kalman.P[0][0]); /* Std. dev in RSSI units */
+    ble_filter_stats.updates++;
+    b->gated += gated;
+    ble_filter_stats.gated += gated;
+    if (prev != 0 || prev_var != 0) {
+        /* Not the beacon's first estimate */
+        double const step = fabs(b->distance - prev);
+        ble_filter_stats.steps++;
+        ble_filter_stats.step_sum += step;
+        ble_filter_stats.step_sq += step * step;
+        ble_filter_stats.jumps += step > BLE_DISTANCE_JUMP_M;
+    }
 
-            double min_dist = pow(10, (tx_power - (flt_rssi - stddev)) /
-                                          (10 * config_get_path_loss()));
-            double max_dist = pow(10, (tx_power - (flt_rssi + stddev)) /
-                                          (10 * config_get_path_loss()));
-            b->variance =
-                (pow(max_dist - flt_dist, 2) + pow(min_dist - flt_dist, 2)) / 2;
+    b->tx_power = (b->count * b->tx_power + tx_power) / (b->count + 1);
+    b->count++;
+    if (b->type == BEACON_IBEACON) {
+        beacon_mark_dirty(b);
+    }
 #if 0
-            double raw_dist = pow(
-                10, ((tx_power - cor_rssi) / (10 * config_get_path_loss())));
+    double raw_dist =
+        pow(10, ((tx_power - cor_rssi) / (10 * config_get_path_loss())));
+#else
+    UNUSED(cor_rssi);
 #endif
-            if (b->type == BEACON_IBEACON) {
+    if (b->type == BEACON_IBEACON) {
 #if 0
-                struct ibeacon_id *id = b->id;
-                log_debug("min: %d, raw/ant_corr/flt/tx_power: %d/%d/%.2f/%d, "
-                          "raw/flt/haab: %.2f/%.2f/%.2f, var: %.2f, error: "
-                          "%.2fm\n",
-                          id->minor, rpt->rssi, cor_rssi, flt_rssi, b->tx_power,
-                          raw_dist, flt_dist, b->distance, b->variance,
-                          sqrt(b->variance));
+        log_debug("min: %d, ant_corr/flt/tx_power: %d/%.2f/%d, "
+                  "raw/flt/haab: %.2f/%.2f/%.2f, var: %.2f, error: "
+                  "%.2fm\n",
+                  IBEACON_KEY_MINOR(b->key), cor_rssi, flt_rssi,
+                  b->tx_power, raw_dist, flt_dist, b->distance, b->variance,
+                  sqrt(b->variance));
 #endif
-            } else if (b->type == BEACON_SECURE) {
+    } else if (b->type == BEACON_SECURE) {
 #if 0
-                struct sbeacon_id *id = b->id;
-                char *mac = hexlify(id->mac, 6);
-                log_debug(
-                    "mac: %s, raw/ant_corr/flt/tx_power: %d/%d/%.2f/%d, "
-                    "raw/flt/haab: %.2f/%.2f/%.2f, var: %.2f, error: %.2fm\n",
-                    mac, rpt->rssi, cor_rssi, flt_rssi, b->tx_power, raw_dist,
-                    flt_dist, b->distance, b->variance, sqrt(b->variance));
-		free(mac);
+        uint8_t addr[6];
+        sbeacon_key_mac(b->key, addr);
+        char *mac = hexlify(addr, 6);
+        log_debug(
+            "mac: %s, ant_corr/flt/tx_power: %d/%.2f/%d, "
+            "raw/flt/haab: %.2f/%.2f/%.2f, var: %.2f, error: %.2fm\n",
+            mac, cor_rssi, flt_rssi, b->tx_power, raw_dist,
+            flt_dist, b->distance, b->variance, sqrt(b->variance));
+        free(mac);
 #endif
-                report_secure(b, rpt->data, rpt->data_len);
-            } else {
-                log_warn("Unknown packet");
-            }
-        skip:
-            free(rpt);
+        report_secure(b, p->data, p->data_len);
+    } else {
+        log_warn("Unknown packet");
+    }
+}
+
+static void ble_flush(void)
+/* Run the filters of every queued advert in one batch, then finish
+   them in the order they arrived */
+{
+    double rssi[KALMAN_BATCH_MAX], var[KALMAN_BATCH_MAX];
+    bool gated[KALMAN_BATCH_MAX];
+    kalman_batch(beacon_filters(), config_params()->kalman, ble_pending_slot,
+                 ble_pending_profile, ble_pending_z, ble_pending_ts, rssi, var,
+                 gated, ble_pending_len);
+    for (size_t i = 0; i < ble_pending_len; i++) {
+        ble_finish(&ble_pending[i], ble_pending_z[i], rssi[i], var[i],
+                   gated[i]);
+    }
+    ble_pending_len = 0;
+}
+
+typedef struct ble_ext_frag_t {
+    /* Partial extended advert waiting for the rest of its chain */
+    bool used;
+    uint8_t adapter;
+    enum ble_addr_t addr_type;
+    uint8_t addr[6];
+    uint8_t sid;
+    uint16_t len;
+    double ts;
+    uint8_t data[BLE_EXT_ADV_MAX_LEN];
+} ble_ext_frag_t;
+
+static ble_ext_frag_t ble_ext_frags[BLE_EXT_FRAG_SLOTS];
+
+static ble_ext_frag_t *ble_ext_frag_find(ble_report_t const *const rpt,
+                                         uint8_t sid) {
+    for (size_t i = 0; i < BLE_EXT_FRAG_SLOTS; i++) {
+        ble_ext_frag_t *f = &ble_ext_frags[i];
+        if (f->used && f->sid == sid && f->adapter == rpt->adapter &&
+            f->addr_type == rpt->addr_type && !memcmp(f->addr, rpt->addr, 6)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static ble_ext_frag_t *ble_ext_frag_new(ble_report_t const *const rpt,
+                                        uint8_t sid, double ts)
+/* Claim a free reassembly slot, reusing the oldest if all are busy */
+{
+    ble_ext_frag_t *f = &ble_ext_frags[0];
+    for (size_t i = 0; i < BLE_EXT_FRAG_SLOTS; i++) {
+        ble_ext_frag_t *c = &ble_ext_frags[i];
+        if (!c->used || ts - c->ts > BLE_EXT_FRAG_TIMEOUT_SEC) {
+            f = c;
+            break;
+        }
+        if (c->ts < f->ts) {
+            f = c;
+        }
+    }
+    f->used = true;
+    f->adapter = rpt->adapter;
+    f->addr_type = rpt->addr_type;
+    memcpy(f->addr, rpt->addr, 6);
+    f->sid = sid;
+    f->len = 0;
+    f->ts = ts;
+    return f;
+}
+
+static void ble_ext_reassemble(ble_report_t *rpt, uint16_t evt_type,
+                               uint8_t sid, double ts)
+/* Stitch chained extended adverts back together. Complete adverts
+   without a pending chain are passed through without copying */
+{
+    uint8_t status = BLE_EXT_EVT_DATA_STATUS(evt_type);
+    ble_ext_frag_t *f = NULL;
+    if (!(evt_type & BLE_EXT_EVT_LEGACY)) {
+        f = ble_ext_frag_find(rpt, sid);
+    }
+    if (status == BLE_EXT_DATA_TRUNCATED) {
+        /* Controller gave up on the chain, we can't use a partial
+           payload */
+        if (f) {
+            f->used = false;
+        }
+        return;
+    }
+    if (!f && status == BLE_EXT_DATA_COMPLETE) {
+        ble_process_report(rpt, ts);
+        return;
+    }
+    if (!f) {
+        f = ble_ext_frag_new(rpt, sid, ts);
+    }
+    if (f->len + rpt->data_len > BLE_EXT_ADV_MAX_LEN) {
+        log_warn("Oversized extended advert dropped");
+        f->used = false;
+        return;
+    }
+    memcpy(f->data + f->len, rpt->data, rpt->data_len);
+    f->len += rpt->data_len;
+    if (status == BLE_EXT_DATA_COMPLETE) {
+        /* RSSI, TX power and address come from the final fragment */
+        rpt->data = f->data;
+        rpt->data_len = f->len;
+        ble_process_report(rpt, ts);
+        f->used = false;
+    }
+}
+
+static void ble_parse_ext_event(uint8_t const *const body, uint8_t param_len,
+                                double ts, uint8_t adapter)
+/* Extended reports are laid out one after another (no interleaving),
+   each a fixed BLE_EXT_REPORT_HDR_LEN header followed by its data */
+{
+    uint8_t const *p = body + 2;
+    uint8_t const *const end = body + param_len;
+    for (uint8_t i = 0; i < body[1]; i++) {
+        if (end - p < BLE_EXT_REPORT_HDR_LEN ||
+            end - p - BLE_EXT_REPORT_HDR_LEN < p[23]) {
+            log_warn("Malformed extended advertising report dropped");
+            return;
+        }
+        uint16_t evt_type = p[0] | p[1] << 8;
+        uint8_t sid = p[11];
+        ble_report_t rpt;
+        if (evt_type & BLE_EXT_EVT_SCAN_RSP) {
+            rpt.evt_type = BLE_EVT_TYPE_SCAN_RSP;
+        } else if (evt_type & BLE_EXT_EVT_CONNECTABLE) {
+            rpt.evt_type = BLE_EVT_TYPE_ADV_IND;
+        } else {
+            rpt.evt_type = BLE_EVT_TYPE_ADV_NONCONN_IND;
+        }
+        rpt.adapter = adapter;
+        rpt.addr_type = p[2];
+        rpt.addr = p + 3;
+        rpt.tx_power = (int8_t)p[12];
+        rpt.rssi = (int8_t)p[13];
+        rpt.data_len = p[23];
+        rpt.data = p + BLE_EXT_REPORT_HDR_LEN;
+        p += BLE_EXT_REPORT_HDR_LEN + rpt.data_len;
+        if (rpt.rssi == BLE_EXT_RSSI_UNAVAILABLE) {
+            continue;
+        }
+        ble_ext_reassemble(&rpt, evt_type, sid, ts);
+    }
+}
+
+static void ble_parse_one(uint8_t const *const evt, size_t len, double ts,
+                          uint8_t adapter)
+/* Parse one complete HCI event packet and hand every advertising
+   report it contains to the beacon pipeline. Nothing is allocated;
+   the reports are views into evt */
+{
+    ble_report_hdr_t const *const hdr = (ble_report_hdr_t const *)evt;
+    if (len < sizeof(ble_report_hdr_t) ||
+        len < offsetof(ble_report_hdr_t, param_len) + 1 + hdr->param_len) {
+        return;
+    }
+    /* Drop the bytes not included in param_len field, that makes
+       it simpler to resolve rssi later on (without magic
+       numbers) */
+    uint8_t const *const body =
+        evt + offsetof(ble_report_hdr_t, param_len) + 1;
+    if (hdr->sub_evt_code == BLE_SUB_EVT_EXT_ADV_REPORT) {
+        ble_parse_ext_event(body, hdr->param_len, ts, adapter);
+        return;
+    } else if (hdr->sub_evt_code != BLE_SUB_EVT_ADV_REPORT) {
+        return;
+    }
+    if (hdr->num_reports == 0 || 2 + 10 * hdr->num_reports > hdr->param_len) {
+        log_warn("Malformed advertising report dropped");
+        return;
+    }
+    for (uint8_t i = 0; i < hdr->num_reports; i++) {
+        ble_report_t rpt;
+        rpt.adapter = adapter;
+        if (ble_get_report(body, hdr, i, &rpt)) {
+            ble_process_report(&rpt, ts);
+        }
+    }
+}
+
+void ble_parse_event(uint8_t const *const evt, size_t len, double ts,
+                     uint8_t adapter)
+/* Parse one complete HCI event packet through the whole pipeline */
+{
+    ble_parse_one(evt, len, ts, adapter);
+    ble_flush();
+}
+
+void ble_parse_batch(ble_pkt_t const *const pkts, size_t n)
+/* Parse a batch of complete HCI event packets, in arrival order; the
+   adverts in it are filtered together */
+{
+    for (size_t i = 0; i < n; i++) {
+        ble_parse_one(pkts[i].data, pkts[i].len, pkts[i].ts,
+                      pkts[i].adapter);
+    }
+    ble_flush();
+}
+
+size_t ble_readcb(struct bufferevent *bev, uint8_t adapter)
+/* Parse every complete HCI event in the bufferevent's input, returns
+   the number of events consumed */
+{
+    size_t count = 0;
+    /* Events that straddle evbuffer chains are linearized here, all
+       other events are parsed in place */
+    static uint8_t scratch[HCI_MAX_EVENT_SIZE];
+    double ts = time_now();
+    ble_report_hdr_t hdr_buf;
+
+    struct evbuffer *input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) >= sizeof(ble_report_hdr_t)) {
+        if (evbuffer_copyout(input, &hdr_buf, sizeof(ble_report_hdr_t)) < 0) {
+            log_error("Failed to read from evbuffer");
+            break;
+        }
+
+        /* By this point the ble_report_hdr is complete */
+        size_t const evt_len =
+            offsetof(ble_report_hdr_t, param_len) + 1 + hdr_buf.param_len;
+        if (evbuffer_get_length(input) < evt_len) {
+            /* All the data hasn't arrived yet, set watermark and
+               retry later */
+            log_notice("Incomplete ble_report");
+            bufferevent_setwatermark(bev, EV_READ, evt_len, 0);
+            break;
+        }
+
+        /* The data has arrived, reset watermark in preparation
+           for the next packet */
+        bufferevent_setwatermark(bev, EV_READ, sizeof(ble_report_hdr_t), 0);
+
+        uint8_t const *evt = NULL;
+        struct evbuffer_iovec vec;
+        if (evbuffer_peek(input, evt_len, NULL, &vec, 1) >= 1 &&
+            vec.iov_len >= evt_len) {
+            evt = vec.iov_base;
+        } else if (evbuffer_copyout(input, scratch, evt_len) ==
+                   (ev_ssize_t)evt_len) {
+            evt = scratch;
+        } else {
+            log_error("Failed to read evbuffer, ble report dropped");
+        }
+        if (evt) {
+            ble_parse_one(evt, evt_len, ts, adapter);
         }
-        free(body_buf);
+        evbuffer_drain(input, evt_len);
+        count++;
     }
+    ble_flush();
+    return count;
 }
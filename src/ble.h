@@ -1,7 +1,45 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include <event2/bufferevent.h>
 
+#define BLE_SUB_EVT_ADV_REPORT 0x02
+#define BLE_SUB_EVT_EXT_ADV_REPORT 0x0D
+
+/* LE controller commands not wrapped by hci_lib */
+#define BLE_OCF_SET_EXT_SCAN_PARAMETERS 0x0041
+#define BLE_OCF_SET_EXT_SCAN_ENABLE 0x0042
+
+#define BLE_EXT_ADV_MAX_LEN 1650 /* Max chained extended advert payload */
+#define BLE_EXT_REPORT_HDR_LEN 24 /* Fixed part of each extended report */
+#define BLE_EXT_FRAG_SLOTS 8      /* Chains reassembled concurrently */
+#define BLE_EXT_FRAG_TIMEOUT_SEC 1
+#define BLE_EXT_RSSI_UNAVAILABLE 127
+#define BLE_EXT_TX_POWER_UNAVAILABLE 127
+
+#define BLE_SECURE_TX_POWER 29    /* Measured power, last secure payload byte */
+#define BLE_TX_POWER_DEFAULT -59  /* RSSI at 1m when the advert has none */
+#define BLE_PATH_LOSS_1M 41       /* dB from transmit power to RSSI at 1m */
+
+/* Extended advertising report Event_Type bits */
+#define BLE_EXT_EVT_CONNECTABLE 0x0001
+#define BLE_EXT_EVT_SCAN_RSP 0x0008
+#define BLE_EXT_EVT_LEGACY 0x0010
+#define BLE_EXT_EVT_DATA_STATUS(evt_type) (((evt_type) >> 5) & 0x03)
+
+enum ble_ext_data_status {
+    BLE_EXT_DATA_COMPLETE = 0x00,
+    BLE_EXT_DATA_MORE,
+    BLE_EXT_DATA_TRUNCATED,
+};
+
+/* Scanning_PHYs bits */
+enum ble_scan_phy {
+    BLE_SCAN_PHY_1M = 0x01,
+    BLE_SCAN_PHY_CODED = 0x04,
+};
+
 enum __attribute__((__packed__)) ble_evt_t {
     BLE_EVT_TYPE_ADV_IND = 0x00,
     BLE_EVT_TYPE_ADV_DIRECT,
@@ -17,14 +55,42 @@ enum __attribute__((__packed__)) ble_addr_t {
     BLE_ADDR_RANDOM_IDENTITY
 };
 
+#define BLE_MAX_ADAPTERS 4
+/* A change in one beacon's distance between adverts big enough to put
+   it in another zone */
+#define BLE_DISTANCE_JUMP_M 1.0
+
+typedef struct ble_scan_params_t {
+    uint8_t own_type;
+    uint8_t scan_type;
+    uint8_t filter_policy;
+    uint8_t filter_dup;
+    uint16_t interval; /* 0.625ms slots */
+    uint16_t window;
+    bool extended;
+} ble_scan_params_t;
+
+typedef struct ble_adapter_t {
+    /* One HCI device scanning for adverts */
+    uint8_t idx;
+    int dev_id;
+    int dd;     /* Scan socket, event filtered */
+    int cmd_dd; /* Controller commands, sent by the parent */
+    int antenna_correction;
+    ble_scan_params_t scan;
+} ble_adapter_t;
+
 typedef struct ble_report_t {
-    /* One report in the HCI event */
+    /* One report in the HCI event, addr and data point into the
+       event buffer and are only valid while it is */
+    uint8_t adapter;         /* Index of the receiving ble_adapter_t */
     enum ble_evt_t evt_type; /* 0x00 -- 0x04 */
     enum ble_addr_t addr_type;
-    uint8_t addr[6];
-    uint8_t data_len;
+    uint8_t const *addr;
+    uint16_t data_len; /* Reassembled extended adverts exceed 255 */
     uint8_t const *data;
     int8_t rssi;
+    int8_t tx_power; /* Transmit power, extended reports only */
 } ble_report_t;
 
 enum __attribute__((__packed__)) hci_type_t {
@@ -39,11 +105,39 @@ typedef struct ble_report_hdr_t {
     enum hci_type_t hci_type;
     uint8_t evt_code;     /* 0x3e */
     uint8_t param_len;    /* Total length of report */
-    uint8_t sub_evt_code; /* 0x02 */
+    uint8_t sub_evt_code; /* 0x02 or 0x0d */
     uint8_t num_reports;  /* 0x01 -- 0x19 */
 } ble_report_hdr_t;
 
-void ble_readcb(struct bufferevent *bev, void *ptr);
+typedef struct ble_pkt_t {
+    /* One complete HCI event packet as read from the socket */
+    uint8_t const *data;
+    size_t len;
+    double ts; /* Arrival time */
+    uint8_t adapter;
+} ble_pkt_t;
+
+/* How steady filtered distances are: each step is the change in one
+   beacon's distance from one advert to its next */
+typedef struct ble_filter_stats {
+    uint64_t updates;
+    uint64_t gated;           /* Updates the Kalman gate took as outliers */
+    uint64_t steps;
+    double step_sum, step_sq; /* Of the size of the steps, m */
+    uint64_t jumps;           /* Steps over BLE_DISTANCE_JUMP_M */
+} ble_filter_stats_t;
+
+size_t ble_readcb(struct bufferevent *bev, uint8_t);
+void ble_parse_event(uint8_t const *const, size_t, double, uint8_t);
+void ble_parse_batch(ble_pkt_t const *const, size_t);
 void ble_scan_loop(int, uint8_t);
-int ble_init(int);
+size_t ble_init(void);
+size_t ble_init_offline(void);
+void ble_cleanup(void);
+size_t ble_adapter_count(void);
+ble_adapter_t const *ble_get_adapter(size_t);
+int ble_scan_pause(void);
+int ble_scan_resume(uint8_t);
 char *hexlify(const uint8_t *, size_t);
+ble_filter_stats_t const *ble_get_filter_stats(void);
+void ble_log_filter_stats(void);
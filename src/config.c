@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <math.h>
 #include <stdint.h>
@@ -12,8 +13,12 @@
 
 #include <libconfig.h>
 
+#include "ble.h"
 #include "config.h"
+#include "distance.h"
+#include "ingest.h"
 #include "log.h"
+#include "sim.h"
 
 extern char hostname[HOSTNAME_MAX_LEN + 1];
 
@@ -25,7 +30,19 @@ static c3_cli_config_t cli_cfg = {.hci_dev_id = -1,
                                   .debug = false,
                                   .config_file = NULL,
                                   .user = NULL,
-                                  .webroot = NULL};
+                                  .webroot = NULL,
+                                  .replay_file = NULL,
+                                  .replay_speed = 1.0,
+                                  .sim_tags = 0,
+                                  .sim_duration = SIM_DEFAULT_DURATION_SEC,
+                                  .sim_seed = SIM_DEFAULT_SEED,
+                                  .benchmark = false};
+
+/* The published snapshot is never written; a reload compiles into the
+   other slot and swaps the pointer. Readers must not hold on to the
+   pointer across event loop iterations */
+static config_params_t config_param_slots[2];
+static config_params_t const *config_params_cur = &config_param_slots[0];
 
 typedef struct setting_typemap_t {
     char *setting;
@@ -55,17 +72,24 @@ static void config_do_cli(int argc, char **argv) {
         static struct option long_options[] = {
             /* These options set a flag. */
             {"debug", no_argument, 0, 'd'},
+            {"benchmark", no_argument, 0, 'B'},
             /* These options don’t set a flag.
                We distinguish them by their indices. */
             {"config", required_argument, 0, 'c'},
             {"user", required_argument, 0, 'u'},
             {"interface", required_argument, 0, 'i'},
             {"webroot", required_argument, 0, 'w'},
+            {"replay", required_argument, 0, 'r'},
+            {"replay-speed", required_argument, 0, 's'},
+            {"simulate", required_argument, 0, 'S'},
+            {"sim-duration", required_argument, 0, 'T'},
+            {"sim-seed", required_argument, 0, 'X'},
             {0, 0, 0, 0}};
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "dc:u:i:w:", long_options, &option_index);
+        c = getopt_long(argc, argv, "dBc:u:i:w:r:s:S:T:X:", long_options,
+                        &option_index);
 
         /* Detect the end of the options. */
         if (c == -1) {
@@ -88,6 +112,26 @@ static void config_do_cli(int argc, char **argv) {
             cli_cfg.webroot = calloc(strlen(optarg) + 1, 1);
             memcpy(cli_cfg.webroot, optarg, strlen(optarg));
             break;
+        case 'r':
+            cli_cfg.replay_file = calloc(strlen(optarg) + 1, 1);
+            memcpy(cli_cfg.replay_file, optarg, strlen(optarg) + 1);
+            break;
+        case 's':
+            /* 0 replays as fast as possible, 1 in real time */
+            cli_cfg.replay_speed = atof(optarg);
+            if (cli_cfg.replay_speed < 0) {
+                cli_cfg.replay_speed = 0;
+            }
+            break;
+        case 'S':
+            cli_cfg.sim_tags = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            cli_cfg.sim_duration = atof(optarg);
+            break;
+        case 'X':
+            cli_cfg.sim_seed = strtoull(optarg, NULL, 0);
+            break;
         case '?':
             /* getopt_long already printed an error message. */
             break;
@@ -95,6 +139,10 @@ static void config_do_cli(int argc, char **argv) {
             /* Debug, keep in foreground */
             cli_cfg.debug = true;
             break;
+        case 'B':
+            /* Run the micro benchmarks and exit */
+            cli_cfg.benchmark = true;
+            break;
         }
         if (c == -1) {
             break;
@@ -107,6 +155,29 @@ static char *config_get_filename(void) {
     return cli_cfg.config_file ? cli_cfg.config_file : DEFAULT_CONFIG_FILE;
 }
 
+config_params_t const *config_params(void) {
+    return __atomic_load_n(&config_params_cur, __ATOMIC_ACQUIRE);
+}
+
+static void config_compile(void)
+/* Snapshot the runtime parameters and publish them */
+{
+    config_params_t const *cur = config_params_cur;
+    config_params_t *next =
+        &config_param_slots[cur == &config_param_slots[0] ? 1 : 0];
+    next->generation = cur->generation + 1;
+    next->path_loss = config_get_path_loss();
+    next->haab = config_get_haab();
+    next->antenna_correction = config_get_antenna_correction();
+    next->report_interval = config_get_report_interval();
+    next->kalman_profiles = config_get_kalman_profiles(
+        next->kalman, next->kalman_uuid, KALMAN_PROFILE_MAX);
+    __atomic_store_n(&config_params_cur, next, __ATOMIC_RELEASE);
+
+    /* Keep the distance tables in step with the model parameters */
+    distance_update(next->path_loss, next->haab);
+}
+
 static void config_do_file(void) {
     char *filename = config_get_filename();
     if (!config_read_file(&cfg, filename)) {
@@ -115,6 +186,7 @@ static void config_do_file(void) {
                   config_error_text(&cfg));
         exit(1);
     }
+    config_compile();
 }
 
 void config_refresh(void) {
@@ -132,28 +204,320 @@ void config_start(int argc, char **argv) {
     config_do_file();
 }
 
+static int config_parse_interface(const char *buf) {
+    if (strlen(buf) > 3) {
+        return atoi(buf + 3);
+    }
+    log_warn("Bad interface in config file: %s", buf);
+    return DEFAULT_HCI_INTERFACE;
+}
+
 int config_get_hci_interface(void) {
     if (cli_cfg.hci_dev_id > 0) {
         return cli_cfg.hci_dev_id;
     } else {
         const char *buf;
         if (config_lookup_string(&cfg, "interface", &buf)) {
-            if (strlen(buf) > 3) {
-                return atoi(buf + 3);
-            } else {
-                log_warn("Bad interface in config file: %s", buf);
-                return DEFAULT_HCI_INTERFACE;
-            }
+            return config_parse_interface(buf);
         } else {
             return DEFAULT_HCI_INTERFACE;
         }
     }
 }
 
+int config_get_ingest_backend(void) {
+    /* Returns an enum ingest_backend */
+    const char *buf;
+    if (!config_lookup_string(&cfg, "ingest", &buf)) {
+        buf = DEFAULT_INGEST_BACKEND;
+    }
+    if (!strcmp(buf, "recvmmsg")) {
+        return INGEST_BACKEND_RECVMMSG;
+    } else if (!strcmp(buf, "thread")) {
+        return INGEST_BACKEND_THREAD;
+    } else if (strcmp(buf, "bufferevent")) {
+        log_warn("Unknown ingest backend in config file: %s", buf);
+    }
+    return INGEST_BACKEND_BUFFEREVENT;
+}
+
+bool config_get_scan_extended(void) {
+    const char *buf;
+    if (!config_lookup_string(&cfg, "scan_mode", &buf)) {
+        buf = DEFAULT_SCAN_MODE;
+    }
+    if (!strcmp(buf, "extended")) {
+        return true;
+    } else if (strcmp(buf, "legacy")) {
+        log_warn("Unknown scan mode in config file: %s", buf);
+    }
+    return false;
+}
+
+uint8_t config_get_scan_phys(void) {
+    /* Returns Scanning_PHYs bits for extended scanning */
+    const char *buf;
+    if (!config_lookup_string(&cfg, "scan_phy", &buf)) {
+        buf = DEFAULT_SCAN_PHY;
+    }
+    if (!strcmp(buf, "1m")) {
+        return BLE_SCAN_PHY_1M;
+    } else if (!strcmp(buf, "coded")) {
+        return BLE_SCAN_PHY_CODED;
+    } else if (strcmp(buf, "both")) {
+        log_warn("Unknown scan PHY in config file: %s", buf);
+    }
+    return BLE_SCAN_PHY_1M | BLE_SCAN_PHY_CODED;
+}
+
+static bool config_parse_hex(const char *str, uint8_t *out, size_t n,
+                             bool reverse)
+/* Parse n bytes of hex, ignoring ':' and '-' separators. reverse
+   stores them last byte first, as HCI expects addresses */
+{
+    size_t i = 0;
+    while (*str && i < n) {
+        unsigned int byte;
+        if (*str == ':' || *str == '-') {
+            str++;
+            continue;
+        }
+        if (!isxdigit((unsigned char)str[0]) ||
+            !isxdigit((unsigned char)str[1]) ||
+            sscanf(str, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[reverse ? n - 1 - i : i] = byte;
+        i++;
+        str += 2;
+    }
+    return i == n && !*str;
+}
+
+size_t config_get_accept_list(uint8_t (*addrs)[6], size_t max) {
+    /* Beacon addresses ("c0:11:22:33:44:55") always passed by the
+       controller filter */
+    config_setting_t *list = config_lookup(&cfg, "accept_list");
+    size_t n = 0;
+    for (int i = 0; list && i < config_setting_length(list) && n < max;
+         i++) {
+        const char *buf = config_setting_get_string_elem(list, i);
+        if (buf && config_parse_hex(buf, addrs[n], 6, true)) {
+            n++;
+        } else {
+            log_warn("Bad address in accept_list: %s", buf ? buf : "");
+        }
+    }
+    return n;
+}
+
+size_t config_get_accept_uuids(uint8_t (*uuids)[16], size_t max) {
+    /* iBeacon UUIDs whose addresses are learned into the controller
+       filter */
+    config_setting_t *list = config_lookup(&cfg, "accept_uuids");
+    size_t n = 0;
+    for (int i = 0; list && i < config_setting_length(list) && n < max;
+         i++) {
+        const char *buf = config_setting_get_string_elem(list, i);
+        if (buf && config_parse_hex(buf, uuids[n], 16, false)) {
+            n++;
+        } else {
+            log_warn("Bad UUID in accept_uuids: %s", buf ? buf : "");
+        }
+    }
+    return n;
+}
+
+static bool config_setting_number(config_setting_t const *setting,
+                                  double *out)
+/* A float or int setting as a double */
+{
+    switch (setting ? config_setting_type(setting) : CONFIG_TYPE_NONE) {
+    case CONFIG_TYPE_FLOAT:
+        *out = config_setting_get_float(setting);
+        return true;
+    case CONFIG_TYPE_INT:
+        *out = config_setting_get_int(setting);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool config_member_number(config_setting_t const *group,
+                                 char const *name, double *out) {
+    return config_setting_number(config_setting_get_member(group, name), out);
+}
+
+static void config_kalman_profile(config_setting_t *group,
+                                  kalman_profile_t *p, char const *name)
+/* Override p with the settings in group, keeping p where they would
+   not make a usable filter */
+{
+    kalman_profile_t n = *p;
+    config_setting_t *cov;
+    const char *action;
+    double v;
+    int adaptive;
+    if (!group) {
+        return;
+    }
+    config_member_number(group, "process_noise", &n.q);
+    config_member_number(group, "measurement_variance", &n.r);
+    if ((cov = config_setting_get_member(group, "initial_covariance"))) {
+        /* [P00, P01, P11] */
+        if (config_setting_length(cov) != 3 ||
+            !config_setting_number(config_setting_get_elem(cov, 0), &n.p00) ||
+            !config_setting_number(config_setting_get_elem(cov, 1), &n.p01) ||
+            !config_setting_number(config_setting_get_elem(cov, 2), &n.p11)) {
+            log_warn("Kalman profile %s: initial_covariance is not "
+                     "[P00, P01, P11]",
+                     name);
+            n.p00 = p->p00;
+            n.p01 = p->p01;
+            n.p11 = p->p11;
+        }
+    }
+    if (config_setting_lookup_bool(group, "adaptive", &adaptive)) {
+        n.alpha = adaptive ? 1.0 / KALMAN_ADAPTIVE_WINDOW : 0;
+    }
+    if (n.alpha > 0 && config_member_number(group, "adaptive_window", &v)) {
+        n.alpha = v >= 1 ? 1 / v : n.alpha;
+    }
+    config_member_number(group, "gate_sigma", &n.gate);
+    if (config_setting_lookup_string(group, "gate_action", &action)) {
+        if (!strcmp(action, "discard")) {
+            n.gate_drop = true;
+        } else if (!strcmp(action, "downweight")) {
+            n.gate_drop = false;
+        } else {
+            log_warn("Kalman profile %s: gate_action is not \"discard\" or "
+                     "\"downweight\"",
+                     name);
+        }
+    }
+    /* R is bounded so KALMAN_ADAPTIVE_RANGE * R fits in Q16.16 */
+    if (n.q < 0 || n.r <= 0 || n.r > KALMAN_MEASUREMENT_VARIANCE_MAX ||
+        n.p00 <= 0 || n.p11 < 0 || n.p01 * n.p01 > n.p00 * n.p11 ||
+        (n.gate != 0 && (n.gate < 1 || n.gate > KALMAN_GATE_MAX))) {
+        log_warn("Kalman profile %s is not a valid filter, ignored", name);
+        return;
+    }
+    *p = n;
+}
+
+size_t config_get_kalman_profiles(kalman_profile_t *profiles,
+                                  uint8_t (*uuids)[16], size_t max)
+/* Fills the Kalman filter profiles from the 'kalman' group: its own
+   settings for every beacon, overridden per class by its 'ibeacon'
+   and 'secure' groups and per UUID, over the iBeacon class, by its
+   'uuids' list. Returns the number of profiles */
+{
+    config_setting_t *group = config_lookup(&cfg, "kalman");
+    kalman_profile_t base = KALMAN_PROFILE_DEFAULT;
+    size_t n = KALMAN_PROFILE_UUID;
+    config_kalman_profile(group, &base, "kalman");
+    profiles[KALMAN_PROFILE_IBEACON] = profiles[KALMAN_PROFILE_SECURE] = base;
+    if (!group) {
+        return n;
+    }
+    config_kalman_profile(config_setting_get_member(group, "ibeacon"),
+                          &profiles[KALMAN_PROFILE_IBEACON], "ibeacon");
+    config_kalman_profile(config_setting_get_member(group, "secure"),
+                          &profiles[KALMAN_PROFILE_SECURE], "secure");
+
+    config_setting_t *list = config_setting_get_member(group, "uuids");
+    for (int i = 0; list && i < config_setting_length(list) && n < max;
+         i++) {
+        config_setting_t *entry = config_setting_get_elem(list, i);
+        const char *buf = NULL;
+        if (!config_setting_lookup_string(entry, "uuid", &buf) ||
+            !config_parse_hex(buf, uuids[n], 16, false)) {
+            log_warn("Bad UUID in kalman uuids: %s", buf ? buf : "");
+            continue;
+        }
+        profiles[n] = profiles[KALMAN_PROFILE_IBEACON];
+        config_kalman_profile(entry, &profiles[n], buf);
+        n++;
+    }
+    if (list &&
+        config_setting_length(list) > (int)(max - KALMAN_PROFILE_UUID)) {
+        log_warn("Only the first %zu kalman uuids are used",
+                 max - KALMAN_PROFILE_UUID);
+    }
+    return n;
+}
+
+size_t config_get_adapters(c3_adapter_config_t *adapters, size_t max)
+/* Fills adapters from the 'adapters' list, falling back to the single
+   'interface' setting. Returns the number of adapters to scan on */
+{
+    config_setting_t *list = config_lookup(&cfg, "adapters");
+    size_t n = 0;
+    if (cli_cfg.hci_dev_id > 0 || !list || !config_setting_length(list)) {
+        adapters[0].dev_id = config_get_hci_interface();
+        adapters[0].antenna_correction = CONFIG_ANTENNA_CORRECTION_GLOBAL;
+        adapters[0].scan_interval = DEFAULT_SCAN_INTERVAL;
+        adapters[0].scan_window = DEFAULT_SCAN_WINDOW;
+        return 1;
+    }
+    for (int i = 0; i < config_setting_length(list) && n < max; i++) {
+        config_setting_t *entry = config_setting_get_elem(list, i);
+        c3_adapter_config_t *a = &adapters[n];
+        const char *name;
+        int ival;
+        if (!config_setting_lookup_string(entry, "interface", &name)) {
+            log_warn("Adapter %d has no interface, skipped", i);
+            continue;
+        }
+        a->dev_id = config_parse_interface(name);
+        if (!config_setting_lookup_int(entry, "antenna_correction",
+                                       &a->antenna_correction)) {
+            a->antenna_correction = CONFIG_ANTENNA_CORRECTION_GLOBAL;
+        }
+        a->scan_interval =
+            config_setting_lookup_int(entry, "scan_interval", &ival)
+                ? ival
+                : DEFAULT_SCAN_INTERVAL;
+        a->scan_window = config_setting_lookup_int(entry, "scan_window", &ival)
+                             ? ival
+                             : DEFAULT_SCAN_WINDOW;
+        n++;
+    }
+    if (config_setting_length(list) > (int)max) {
+        log_warn("Only the first %zu adapters are used", max);
+    }
+    return n;
+}
+
 bool config_debug(void) {
     return cli_cfg.debug;
 }
 
+bool config_benchmark(void) {
+    return cli_cfg.benchmark;
+}
+
+const char *config_get_replay_file(void) {
+    return cli_cfg.replay_file;
+}
+
+double config_get_replay_speed(void) {
+    return cli_cfg.replay_speed;
+}
+
+size_t config_get_sim_tags(void) {
+    return cli_cfg.sim_tags;
+}
+
+double config_get_sim_duration(void) {
+    return cli_cfg.sim_duration;
+}
+
+uint64_t config_get_sim_seed(void) {
+    return cli_cfg.sim_seed;
+}
+
 const char *config_get_remote_hostname(void) {
     const char *buf;
     if (config_lookup_string(&cfg, "server", &buf)) {
@@ -272,6 +636,56 @@ int config_get_antenna_correction(void) {
     }
 }
 
+size_t config_get_beacon_memory(void)
+/* Bytes beacons may use, 0 for no limit */
+{
+    int buf;
+    if (!config_lookup_int(&cfg, "beacon_memory_kb", &buf) || buf < 0) {
+        buf = DEFAULT_BEACON_MEMORY_KB;
+    }
+    return (size_t)buf * 1024;
+}
+
+size_t config_get_max_beacons(void)
+/* Beacons tracked at once, 0 for no limit */
+{
+    int buf;
+    if (!config_lookup_int(&cfg, "max_beacons", &buf) || buf < 0) {
+        buf = DEFAULT_MAX_BEACONS;
+    }
+    return buf;
+}
+
+int config_get_walk_budget_usec(void)
+/* Microseconds a walk over the beacons may run before yielding */
+{
+    int buf;
+    if (!config_lookup_int(&cfg, "walk_budget_usec", &buf) || buf <= 0) {
+        buf = DEFAULT_WALK_BUDGET_USEC;
+    }
+    return buf;
+}
+
+const char *config_get_snapshot_file(void)
+/* Where beacon state is kept across restarts, "" for nowhere */
+{
+    const char *buf;
+    if (!config_lookup_string(&cfg, "snapshot_file", &buf)) {
+        buf = DEFAULT_SNAPSHOT_FILE;
+    }
+    return buf;
+}
+
+int config_get_admission_sightings(void)
+/* Adverts a new secure beacon address needs before it is tracked */
+{
+    int buf;
+    if (!config_lookup_int(&cfg, "admission_sightings", &buf) || buf < 0) {
+        buf = DEFAULT_ADMISSION_SIGHTINGS;
+    }
+    return buf;
+}
+
 struct timeval config_get_report_interval(void) {
     int buf;
     if (!config_lookup_int(&cfg, "report_interval", &buf)) {
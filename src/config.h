@@ -1,16 +1,17 @@
 #pragma once
 
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/time.h>
+
+#include "kalman.h"
 
 #define UNUSED(x) (void)(x)
 
 #define HOSTNAME_MAX_LEN 255
-#define MAX_HASH_CB                                                            \
-    5 /* Max number of functions called on each                                \
-         location during hash table walk */
-
 #define GC_INTERVAL_SEC                                                        \
     (MAX_BEACON_INACTIVE_SEC / 2) /* How often to                              \
                                      check for                                 \
@@ -37,7 +38,17 @@
 #define DEFAULT_ANTENNA_CORRECTION 0
 #define DEFAULT_REPORT_INTERVAL_MSEC 5000
 #define DEFAULT_USER "nobody"
+#define DEFAULT_INGEST_BACKEND "bufferevent"
+#define DEFAULT_SCAN_MODE "legacy"
+#define DEFAULT_SCAN_INTERVAL 0x0064 /* 0.625ms slots */
+#define DEFAULT_SCAN_WINDOW 0x0064
+#define DEFAULT_SCAN_PHY "both"
 #define DEFAULT_WEBROOT "./web"
+#define DEFAULT_BEACON_MEMORY_KB 16384 /* 0 for no limit */
+#define DEFAULT_MAX_BEACONS 0 /* 0 for no limit but beacon_memory_kb */
+#define DEFAULT_WALK_BUDGET_USEC 1000 /* Per turn of a sliced walk */
+#define DEFAULT_SNAPSHOT_FILE "/run/c3listener/beacons.snap"
+#define DEFAULT_ADMISSION_SIGHTINGS 3 /* 0 or 1 to track at once */
 
 #define SERVER_RECONNECT_INTERVAL_SEC 10
 
@@ -50,18 +61,71 @@ typedef struct cli_conf {
     char *config_file;
     char *user;
     char *webroot;
+    char *replay_file;
+    double replay_speed;
+    size_t sim_tags;
+    double sim_duration;
+    uint64_t sim_seed;
+    bool benchmark;
 } c3_cli_config_t;
 
+/* Adapters without their own antenna_correction follow the global
+   setting, which can change at runtime */
+#define CONFIG_ANTENNA_CORRECTION_GLOBAL INT_MIN
+
+typedef struct config_params {
+    /* Runtime parameters compiled from the config file, read on the
+       hot path. Immutable once published; bumps generation on every
+       (re)load */
+    uint64_t generation;
+    double path_loss;
+    double haab;
+    int antenna_correction;
+    struct timeval report_interval;
+    /* Filter profiles by enum kalman_profiles, then one per UUID in
+       kalman_uuid from KALMAN_PROFILE_UUID up to kalman_profiles */
+    kalman_profile_t kalman[KALMAN_PROFILE_MAX];
+    uint8_t kalman_uuid[KALMAN_PROFILE_MAX][16];
+    size_t kalman_profiles;
+} config_params_t;
+
+typedef struct adapter_conf {
+    int dev_id;
+    int antenna_correction;
+    uint16_t scan_interval;
+    uint16_t scan_window;
+} c3_adapter_config_t;
+
 void config_cleanup(void);
+config_params_t const *config_params(void);
 const char *config_get_user(void);
 struct timeval config_get_report_interval(void);
 int config_get_antenna_correction(void);
 double config_get_haab(void);
 double config_get_path_loss(void);
+size_t config_get_beacon_memory(void);
+size_t config_get_max_beacons(void);
+int config_get_admission_sightings(void);
+int config_get_walk_budget_usec(void);
+const char *config_get_snapshot_file(void);
 const char *config_get_remote_port(void);
 const char *config_get_remote_hostname(void);
 bool config_debug(void);
+bool config_benchmark(void);
+const char *config_get_replay_file(void);
+double config_get_replay_speed(void);
+size_t config_get_sim_tags(void);
+double config_get_sim_duration(void);
+uint64_t config_get_sim_seed(void);
 int config_get_hci_interface(void);
+size_t config_get_adapters(c3_adapter_config_t *, size_t);
+int config_get_ingest_backend(void);
+bool config_get_scan_extended(void);
+uint8_t config_get_scan_phys(void);
+size_t config_get_accept_list(uint8_t (*)[6], size_t);
+size_t config_get_accept_uuids(uint8_t (*)[16], size_t);
+size_t config_get_kalman_profiles(kalman_profile_t *, uint8_t (*)[16],
+                                  size_t);
 void config_start(int argc, char **argv);
 const char *config_get_webroot(void);
 int config_set(char *, char *);
@@ -0,0 +1,188 @@
+/* distance.c - RSSI to distance model
+ *
+ *   Distance follows the log-distance path loss model,
+ *   d = 10^((tx_power - rssi) / (10 * path_loss)), corrected for the
+ *   height of the antenna above the beacons (haab). Its variance comes
+ *   from the Kalman filter's RSSI variance P, linearized around the
+ *   estimate:
+ *
+ *     var = ((d/g - d)^2 + (d*g - d)^2) / 2 = d^2 * V(P)
+ *     g = 10^(sqrt(P) / (10 * path_loss))
+ *
+ *   d and the haab corrected distance only depend on the dB delta
+ *   tx_power - rssi and V only on P, so all of it is tabulated in
+ *   three 1-D tables with linear interpolation. They are rebuilt
+ *   whenever path_loss or haab change, with the step halved until the
+ *   interpolation error stays inside DISTANCE_MAX_REL_ERR. That
+ *   takes pow() and sqrt() out of the per advert path, which matters
+ *   on soft-float targets. Inputs outside the tables use the exact
+ *   math.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+
+#include "distance.h"
+#include "log.h"
+
+typedef struct distance_lut {
+    double min, step, inv_step;
+    size_t len;
+    double v[DISTANCE_LUT_MAX];
+} distance_lut_t;
+
+static distance_lut_t lut_dist, lut_haab, lut_var;
+static distance_stats_t distance_stats = {.path_loss = NAN, .haab = NAN};
+/* ln(10) / (10 * path_loss), so that d = exp(k * delta) */
+static double distance_k = 0;
+static double distance_haab = 0;
+
+distance_stats_t const *distance_get_stats(void) {
+    return &distance_stats;
+}
+
+static double distance_f_dist(double delta) {
+    return exp(distance_k * delta);
+}
+
+static double distance_f_haab(double delta) {
+    double d = distance_f_dist(delta);
+    double r = d * d - distance_haab * distance_haab;
+    return r > 0 ? sqrt(r) : 0;
+}
+
+static double distance_f_var(double p)
+/* V(P); written with sinh to stay accurate for small P */
+{
+    double x = distance_k * sqrt(p);
+    double s1 = sinh(x), s2 = sinh(x / 2);
+    return 2 * s1 * s1 - 4 * s2 * s2;
+}
+
+static void distance_build(distance_lut_t *lut, double (*f)(double),
+                           double min, double max, double step,
+                           double budget, double floor)
+/* Tabulate f over [min, max], halving the step until linear
+   interpolation is within budget at every midpoint. Errors are
+   relative to |f|, or to floor where f is smaller than that */
+{
+    while (1) {
+        size_t len = ceil((max - min) / step) + 1;
+        if (len >= DISTANCE_LUT_MAX) {
+            len = DISTANCE_LUT_MAX;
+            step = (max - min) / (len - 1);
+        }
+        lut->min = min;
+        lut->step = step;
+        lut->inv_step = 1 / step;
+        lut->len = len;
+        for (size_t i = 0; i < len; i++) {
+            lut->v[i] = f(min + i * step);
+        }
+        if (len == DISTANCE_LUT_MAX) {
+            log_warn("Distance table capped at %d entries", DISTANCE_LUT_MAX);
+            return;
+        }
+        bool ok = true;
+        for (size_t i = 0; ok && i + 1 < len; i++) {
+            double exact = f(min + (i + 0.5) * step);
+            double err = fabs((lut->v[i] + lut->v[i + 1]) / 2 - exact);
+            ok = err <= budget * fmax(fabs(exact), floor);
+        }
+        if (ok) {
+            return;
+        }
+        step /= 2;
+    }
+}
+
+static inline bool distance_lookup(distance_lut_t const *lut, double x,
+                                   double *y) {
+    double pos = (x - lut->min) * lut->inv_step;
+    if (!(pos >= 0) || pos >= lut->len - 1) {
+        /* Also catches NaN */
+        return false;
+    }
+    size_t i = pos;
+    *y = lut->v[i] + (lut->v[i + 1] - lut->v[i]) * (pos - i);
+    return true;
+}
+
+void distance_update(double path_loss, double haab)
+/* Rebuild the tables if the model parameters changed */
+{
+    if (path_loss == distance_stats.path_loss && haab == distance_stats.haab) {
+        return;
+    }
+    distance_k = log(10) / (10 * path_loss);
+    distance_haab = haab;
+
+    /* The variance is d^2 * V, so d gets a quarter of the budget and
+       V half. exp(k * delta) has relative midpoint error
+       (k * step)^2 / 8 */
+    double const dist_budget = DISTANCE_MAX_REL_ERR / 4;
+    distance_build(&lut_dist, distance_f_dist, DISTANCE_DELTA_MIN,
+                   DISTANCE_DELTA_MAX, sqrt(8 * dist_budget) / distance_k,
+                   dist_budget, 1.0);
+    distance_build(&lut_var, distance_f_var, 0, DISTANCE_P_MAX,
+                   DISTANCE_P_MAX / 64, DISTANCE_MAX_REL_ERR / 2, 0);
+    lut_haab.len = 0;
+    if (haab > 0) {
+        /* The correction has a sqrt singularity where d == haab, so
+           only tabulate from d == 2 * haab; closer in is rare and
+           computed exactly */
+        double min = fmax(log(2 * haab) / distance_k, DISTANCE_DELTA_MIN);
+        if (min < DISTANCE_DELTA_MAX) {
+            distance_build(&lut_haab, distance_f_haab, min, DISTANCE_DELTA_MAX,
+                           lut_dist.step, DISTANCE_MAX_REL_ERR, 1.0);
+        }
+    }
+
+    distance_stats.path_loss = path_loss;
+    distance_stats.haab = haab;
+    distance_stats.entries = lut_dist.len + lut_var.len + lut_haab.len;
+    distance_stats.delta_step = lut_dist.step;
+    distance_stats.p_step = lut_var.step;
+    distance_stats.rebuilds++;
+    log_notice("Distance tables for path_loss %.2f, haab %.2f: %zu entries",
+               path_loss, haab, distance_stats.entries);
+}
+
+void distance_estimate(int8_t tx_power, double rssi, double p,
+                       double *distance, double *variance)
+/* Distance and its variance for a filtered RSSI with variance p */
+{
+    double delta = tx_power - rssi;
+    double d, v;
+    if (!distance_lookup(&lut_dist, delta, &d)) {
+        distance_stats.misses++;
+        d = distance_f_dist(delta);
+    }
+    if (distance_haab == 0) {
+        *distance = d;
+    } else if (!distance_lookup(&lut_haab, delta, distance)) {
+        /* Too ill-conditioned near haab to reuse the interpolated d */
+        *distance = distance_f_haab(delta);
+    }
+    if (!distance_lookup(&lut_var, p, &v)) {
+        distance_stats.misses++;
+        v = distance_f_var(p);
+    }
+    *variance = d * d * v;
+}
+
+void distance_estimate_exact(int8_t tx_power, double rssi, double p,
+                             double path_loss, double haab, double *distance,
+                             double *variance)
+/* The model evaluated directly, as a reference for the tables */
+{
+    double flt_dist = pow(10, (tx_power - rssi) / (10 * path_loss));
+    *distance = sqrt(pow(flt_dist, 2) - pow(haab, 2));
+    if (isnan(*distance)) {
+        *distance = 0;
+    }
+    double stddev = sqrt(p);
+    double min_dist = pow(10, (tx_power - (rssi - stddev)) / (10 * path_loss));
+    double max_dist = pow(10, (tx_power - (rssi + stddev)) / (10 * path_loss));
+    *variance = (pow(max_dist - flt_dist, 2) + pow(min_dist - flt_dist, 2)) / 2;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISTANCE_MAX_REL_ERR                                                   \
+    1E-3 /* Interpolation error budget; 1cm at                                 \
+            10m, below report resolution */
+#define DISTANCE_LUT_MAX 2048    /* Most entries one table may grow to */
+#define DISTANCE_DELTA_MIN -40.0  /* tx_power - rssi covered by the tables, */
+#define DISTANCE_DELTA_MAX 120.0  /* dB; exact math is used outside */
+#define DISTANCE_P_MAX 64.0       /* Largest Kalman RSSI variance tabulated */
+
+typedef struct distance_stats {
+    double path_loss, haab; /* Parameters the tables were built for */
+    size_t entries;         /* Across all tables */
+    double delta_step, p_step;
+    uint64_t rebuilds;
+    uint64_t misses; /* Estimates that fell outside the tables */
+} distance_stats_t;
+
+void distance_update(double, double);
+void distance_estimate(int8_t, double, double, double *, double *);
+void distance_estimate_exact(int8_t, double, double, double, double, double *,
+                             double *);
+distance_stats_t const *distance_get_stats(void);
@@ -2,113 +2,115 @@
  *
  *   Shawn Nock 2015
  *
+ *   Keyed hashing for the tables generated by HASH_TABLE_DEFINE;
+ *   SipHash-1-3, as in Rust's and Python's hash tables.
  */
 
-#include <stdlib.h>
-
-#include "c3listener.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "hash.h"
 #include "log.h"
 
-static void *hashtable[HASH_TABLE_LENGTH] = {NULL};
+/* Fixed until seeded, so offline runs iterate in a repeatable order */
+static uint64_t hash_k0 = 0x0706050403020100ULL;
+static uint64_t hash_k1 = 0x0f0e0d0c0b0a0908ULL;
 
-static int hash_index(void *obj, index_cb index) {
-    return index(obj) % HASH_TABLE_LENGTH;
-}
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1;                                                              \
+        v1 = ROTL(v1, 13);                                                     \
+        v1 ^= v0;                                                              \
+        v0 = ROTL(v0, 32);                                                     \
+        v2 += v3;                                                              \
+        v3 = ROTL(v3, 16);                                                     \
+        v3 ^= v2;                                                              \
+        v0 += v3;                                                              \
+        v3 = ROTL(v3, 21);                                                     \
+        v3 ^= v0;                                                              \
+        v2 += v1;                                                              \
+        v1 = ROTL(v1, 17);                                                     \
+        v1 ^= v2;                                                              \
+        v2 = ROTL(v2, 32);                                                     \
+    } while (0)
 
-void hash_delete(void *obj, index_cb index, equal_p equal, delete_cb delete) {
-    hashable_t *v = hash_find(obj, index, equal);
-    if (v != NULL) {
-        if (v->prev == NULL) {
-            /* Beacon is root of linked list */
-            int idx = hash_index(obj, index);
-            if (v->next != NULL) {
-                hashtable[idx] = v->next;
-            } else {
-                v = hashtable[idx];
-                hashtable[idx] = NULL;
-            }
-        } else {
-            if (v->next != NULL) {
-                /* Beacon is middle of list */
-                v->prev->next = v->next;
-                v->next->prev = v->prev;
-            } else {
-                /* Beacon is end of LL */
-                v->prev->next = NULL;
-            }
+uint64_t hash_bytes(void const *data, size_t len) {
+    uint8_t const *p = data;
+    uint64_t v0 = hash_k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = hash_k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = hash_k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = hash_k1 ^ 0x7465646279746573ULL;
+    uint64_t b = (uint64_t)len << 56;
+    size_t const tail = len & 7;
+    uint8_t const *const end = p + len - tail;
+
+    for (; p != end; p += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; i++) {
+            m |= (uint64_t)p[i] << (8 * i);
         }
-        /* Make sure v points to the removed node */
-        delete (v);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+    for (size_t i = 0; i < tail; i++) {
+        b |= (uint64_t)p[i] << (8 * i);
     }
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-void *hash_find(void *obj, index_cb index, equal_p equal) {
-    hashable_t *v = hashtable[index(obj) % HASH_TABLE_LENGTH];
-    do {
-        if (obj == v || equal(obj, v)) {
-            return v;
-        }
-    } while ((v = v->next));
-    return NULL;
-}
+uint64_t hash_u64(uint64_t m)
+/* hash_bytes of m's eight bytes in little endian order, unrolled */
+{
+    uint64_t v0 = hash_k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = hash_k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = hash_k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = hash_k1 ^ 0x7465646279746573ULL;
+    uint64_t const b = (uint64_t)8 << 56;
 
-void *hash_add(void *obj, index_cb index, equal_p equal) {
-    /* Expects obj to be a malloc'd region or otherwise persistant until
-       hash_delete is called */
-    int idx = hash_index(obj, index);
-    hashable_t *v = NULL, *v_last = NULL;
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
 
-    if ((v = hashtable[idx]) != NULL) {
-        /* obj or collision exists */
-        do {
-            v_last = v;
-            if (obj == v || equal(obj, v)) {
-                /* A match */
-                /* log_debug("Hit\n"); */
-                return v;
-            } else {
-                /* Collision */
-                /* log_debug("Collision\n"); */
-            }
-        } while ((v = v->next));
-    }
-    /* The object isn't in the table, insert it. Hang the beacon off
-       last collision, or on the hash table directly */
-    v = obj;
-    if (v_last != NULL) {
-        v_last->next = v;
-        v->prev = v_last;
-        v->next = NULL;
-    } else {
-        hashtable[idx] = v;
-        v->prev = v->next = NULL;
-    }
-    /* log_debug("Created\n"); */
-    return v;
+void hash_seed(uint64_t k0, uint64_t k1) {
+    hash_k0 = k0;
+    hash_k1 = k1;
 }
 
-void hash_walk(walker_cb *walker, void **args, size_t size) {
-    if (size < 1) {
-        /* We don't have any work todo, skip walk */
-        return;
+void hash_seed_random(void)
+/* Key the hash so table layout can't be predicted from the air */
+{
+    uint64_t k[2];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, k, sizeof(k)) != sizeof(k)) {
+        log_warn("Failed to seed hash from /dev/urandom: %s",
+                 strerror(errno));
+        k[0] = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid();
+        k[1] = (uint64_t)clock() ^ (uintptr_t)&k;
     }
-    for (int i = 0; i < HASH_TABLE_LENGTH; i++) {
-        hashable_t *v = hashtable[i];
-        while (v != NULL) {
-            for (size_t j = 0; j < size; j++) {
-                v = walker[j](v, args[j]);
-                if (v == NULL) {
-                    break;
-                }
-            }
-            if (v == NULL) {
-                /* walker functions can NULL v, i.e. if the object is
-                   deleted. We cannot reason about any other chained nodes. */
-                continue;
-            }
-            v = v->next;
-        }
+    if (fd >= 0) {
+        close(fd);
     }
+    hash_seed(k[0], k[1]);
 }
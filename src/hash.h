@@ -1,27 +1,186 @@
 #ifndef __HASH_H
 #define __HASH_H
 
+/* Open addressing hash tables
+ *
+ *   HASH_TABLE_DEFINE(name, key_t, val_t) generates a table type
+ *   name_t and static inline functions for it, so lookups are
+ *   specialized for the key type rather than going through callbacks.
+ *   Keys live inline in the slots next to their cached hash, so a hit
+ *   usually touches a single cache line. key_t must not contain
+ *   padding: keys are hashed and compared as bytes, or as one word
+ *   when they are 64 bits.
+ *
+ *   Slots are probed linearly from a keyed SipHash of the key, so
+ *   adverts crafted to collide can't degrade the table. Removal leaves
+ *   a tombstone, which keeps iteration safe while removing; tables
+ *   grow (or are rehashed in place to shed tombstones) above
+ *   HASH_MAX_LOAD.
+ */
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_MIN_SLOTS 16
+#define HASH_MAX_LOAD 0.75 /* Of slots in use or tombstoned */
+
+/* Cached hash values 0 and 1 mark empty and tombstoned slots */
+#define HASH_EMPTY 0
+#define HASH_TOMBSTONE 1
+#define HASH_SLOT_FULL(s) ((s)->hash > HASH_TOMBSTONE)
+
+/* Define before including to allocate slots some other way */
+#ifndef HASH_CALLOC
+#define HASH_CALLOC calloc
+#define HASH_FREE free
+#endif
+
+uint64_t hash_bytes(void const *, size_t);
+uint64_t hash_u64(uint64_t);
+void hash_seed(uint64_t, uint64_t);
+void hash_seed_random(void);
 
-#define HASH_TABLE_LENGTH                                                      \
-    251 /* Ought to be prime and approximately                                 \
-           as large as expected number of                                      \
-           entries for best performance */
-
-typedef struct generic_hashtable_obj {
-    struct generic_hashtable_obj *next, *prev;
-} hashable_t;
-
-typedef bool (*equal_p)(void *a, void *b);
-typedef uint32_t (*index_cb)(void *);
-typedef void *(*walker_cb)(void *, void *);
-typedef bool (*cond_p)(void *);
-typedef void (*delete_cb)(void *);
-
-void hash_delete(void *, index_cb, equal_p, delete_cb);
-void *hash_find(void *, index_cb, equal_p);
-void *hash_add(void *, index_cb, equal_p);
-void hash_walk(walker_cb *, void **, size_t);
+#define HASH_TABLE_DEFINE(name, key_t, val_t)                                  \
+    typedef struct name##_slot {                                               \
+        uint32_t hash;                                                         \
+        key_t key;                                                             \
+        val_t val;                                                             \
+    } name##_slot_t;                                                           \
+                                                                               \
+    typedef struct name {                                                      \
+        name##_slot_t *slots;                                                  \
+        size_t mask; /* Slot count - 1, zero until first insert */             \
+        size_t used, tombstones;                                               \
+    } name##_t;                                                                \
+                                                                               \
+    static inline uint32_t name##_hash(key_t const *key) {                     \
+        uint32_t h;                                                            \
+        if (sizeof(key_t) == sizeof(uint64_t)) {                               \
+            /* Single word keys skip the byte loop */                          \
+            uint64_t w;                                                        \
+            memcpy(&w, key, sizeof(w));                                        \
+            h = hash_u64(w);                                                   \
+        } else {                                                               \
+            h = hash_bytes(key, sizeof(key_t));                                \
+        }                                                                      \
+        return h > HASH_TOMBSTONE ? h : h + 2;                                 \
+    }                                                                          \
+                                                                               \
+    static inline name##_slot_t *name##_lookup(name##_t const *t,              \
+                                               key_t const *key,               \
+                                               uint32_t h) {                   \
+        /* Slot holding key, or NULL */                                        \
+        if (!t->slots) {                                                       \
+            return NULL;                                                       \
+        }                                                                      \
+        for (size_t i = h & t->mask;; i = (i + 1) & t->mask) {                 \
+            name##_slot_t *s = &t->slots[i];                                   \
+            if (s->hash == HASH_EMPTY) {                                       \
+                return NULL;                                                   \
+            }                                                                  \
+            if (s->hash == h && !memcmp(&s->key, key, sizeof(key_t))) {        \
+                return s;                                                      \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static inline val_t *name##_find(name##_t const *t, key_t const *key) {    \
+        name##_slot_t *s = name##_lookup(t, key, name##_hash(key));            \
+        return s ? &s->val : NULL;                                             \
+    }                                                                          \
+                                                                               \
+    static inline bool name##_resize(name##_t *t, size_t slots) {              \
+        name##_slot_t *old = t->slots;                                         \
+        size_t old_slots = old ? t->mask + 1 : 0;                              \
+        t->slots = HASH_CALLOC(slots, sizeof(name##_slot_t));                  \
+        if (!t->slots) {                                                       \
+            t->slots = old;                                                    \
+            return false;                                                      \
+        }                                                                      \
+        t->mask = slots - 1;                                                   \
+        t->tombstones = 0;                                                     \
+        for (size_t i = 0; i < old_slots; i++) {                               \
+            if (HASH_SLOT_FULL(&old[i])) {                                     \
+                size_t j = old[i].hash & t->mask;                              \
+                while (t->slots[j].hash != HASH_EMPTY) {                       \
+                    j = (j + 1) & t->mask;                                     \
+                }                                                              \
+                t->slots[j] = old[i];                                          \
+            }                                                                  \
+        }                                                                      \
+        HASH_FREE(old);                                                        \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline val_t *name##_insert(name##_t *t, key_t const *key,          \
+                                       bool *found) {                          \
+        /* Slot value for key, added if missing; NULL if out of memory.        \
+           Probes once unless the insert has to grow the table */              \
+        uint32_t h = name##_hash(key);                                         \
+        name##_slot_t *s = NULL, *free_slot = NULL;                            \
+        for (size_t i = h & t->mask; t->slots; i = (i + 1) & t->mask) {        \
+            s = &t->slots[i];                                                  \
+            if (s->hash == HASH_EMPTY) {                                       \
+                break;                                                         \
+            }                                                                  \
+            if (s->hash == HASH_TOMBSTONE) {                                   \
+                if (!free_slot) {                                              \
+                    free_slot = s;                                             \
+                }                                                              \
+            } else if (s->hash == h &&                                         \
+                       !memcmp(&s->key, key, sizeof(key_t))) {                 \
+                *found = true;                                                 \
+                return &s->val;                                                \
+            }                                                                  \
+        }                                                                      \
+        *found = false;                                                        \
+        size_t slots = t->slots ? t->mask + 1 : 0;                             \
+        if (!free_slot &&                                                      \
+            t->used + t->tombstones + 1 > slots * HASH_MAX_LOAD) {             \
+            size_t want = slots ? slots : HASH_MIN_SLOTS;                      \
+            if (t->used + 1 > want * HASH_MAX_LOAD / 2) {                      \
+                want *= 2;                                                     \
+            }                                                                  \
+            if (!name##_resize(t, want)) {                                     \
+                return NULL;                                                   \
+            }                                                                  \
+            size_t i = h & t->mask;                                            \
+            while (t->slots[i].hash != HASH_EMPTY) {                           \
+                i = (i + 1) & t->mask;                                         \
+            }                                                                  \
+            s = &t->slots[i];                                                  \
+        } else if (free_slot) {                                                \
+            s = free_slot;                                                     \
+            t->tombstones--;                                                   \
+        }                                                                      \
+        s->hash = h;                                                           \
+        memcpy(&s->key, key, sizeof(key_t));                                   \
+        t->used++;                                                             \
+        return &s->val;                                                        \
+    }                                                                          \
+                                                                               \
+    static inline bool name##_remove(name##_t *t, key_t const *key) {          \
+        name##_slot_t *s = name##_lookup(t, key, name##_hash(key));            \
+        if (!s) {                                                              \
+            return false;                                                      \
+        }                                                                      \
+        s->hash = HASH_TOMBSTONE;                                              \
+        t->used--;                                                             \
+        t->tombstones++;                                                       \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline name##_slot_t *name##_next(name##_t const *t, size_t *i) {   \
+        /* Iterate from *i = 0; removing the returned slot is safe */          \
+        for (; t->slots && *i <= t->mask; (*i)++) {                            \
+            if (HASH_SLOT_FULL(&t->slots[*i])) {                               \
+                return &t->slots[(*i)++];                                      \
+            }                                                                  \
+        }                                                                      \
+        return NULL;                                                           \
+    }
 
 #endif /* __HASH_H */
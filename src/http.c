@@ -27,11 +27,16 @@
 
 #include <uci.h>
 
+#include "accept_list.h"
+#include "admission.h"
 #include "beacon.h"
 #include "ble.h"
 #include "config.h"
+#include "distance.h"
 #include "http.h"
+#include "ingest.h"
 #include "ipc.h"
+#include "snapshot.h"
 #include "time_util.h"
 #include "uci.h"
 #include "udp.h"
@@ -234,17 +239,18 @@ static void network_status_json(struct evhttp_request *req, void *arg) {
     json_object_put(jobj);
 }
 
-static void *beacon_hash_walker(void *ptr, void *jobj) {
-    beacon_t *b = ptr;
+static beacon_t *beacon_json_walker(beacon_t *b, void *jobj) {
     json_object *b_jobj = json_object_new_object();
     json_object_object_add(b_jobj, "type", json_object_new_int(b->type));
     if (b->type == BEACON_IBEACON) {
-        struct ibeacon_id *id = b->id;
-        json_object_object_add(b_jobj, "major", json_object_new_int(id->major));
-        json_object_object_add(b_jobj, "minor", json_object_new_int(id->minor));
+        json_object_object_add(b_jobj, "major",
+                               json_object_new_int(IBEACON_KEY_MAJOR(b->key)));
+        json_object_object_add(b_jobj, "minor",
+                               json_object_new_int(IBEACON_KEY_MINOR(b->key)));
     } else if (b->type == BEACON_SECURE) {
-        struct sbeacon_id *id = b->id;
-        char *mac = hexlify(id->mac, 6);
+        uint8_t addr[6];
+        sbeacon_key_mac(b->key, addr);
+        char *mac = hexlify(addr, 6);
         json_object_object_add(b_jobj, "mac", json_object_new_string(mac));
         free(mac);
     }
@@ -252,25 +258,272 @@ static void *beacon_hash_walker(void *ptr, void *jobj) {
                            json_object_new_double(b->distance));
     json_object_object_add(b_jobj, "error",
                            json_object_new_double(sqrt(b->variance)));
+    json_object_object_add(b_jobj, "gated", json_object_new_int64(b->gated));
     json_object_array_add(jobj, b_jobj);
-    return ptr;
+    return b;
 }
 
-static void beacon_json(struct evhttp_request *req, void *arg) {
+typedef struct beacon_json_req {
+    struct evhttp_request *req;
+    struct evhttp_connection *evcon;
+    beacon_slicer_t *slicer;
+    json_object *b_array;
+} beacon_json_req_t;
+
+static beacon_t *beacon_json_slice_walker(beacon_t *b, void *arg) {
+    beacon_json_req_t *r = arg;
+    return beacon_json_walker(b, r->b_array);
+}
+
+static void beacon_json_closecb(struct evhttp_connection *evcon, void *arg)
+/* The client went away mid walk; stop it and drop what was built */
+{
+    UNUSED(evcon);
+    beacon_json_req_t *r = arg;
+    beacon_walk_cancel(r->slicer);
+    json_object_put(r->b_array);
+    /* A request libevent has already detached from the connection is
+       ours to free, any other goes with the connection */
+    if (!evhttp_request_get_connection(r->req)) {
+        evhttp_request_free(r->req);
+    }
+    free(r);
+}
+
+static void beacon_json_done(void *arg) {
+    beacon_json_req_t *r = arg;
+    evhttp_connection_set_closecb(r->evcon, NULL, NULL);
+    struct evbuffer *buf = evhttp_request_get_output_buffer(r->req);
+    const char *json = json_object_to_json_string(r->b_array);
+    evbuffer_add_printf(buf, "%s", json);
+    json_object_put(r->b_array);
+    evhttp_add_header(evhttp_request_get_output_headers(r->req),
+                      "Content-Type", "application/json");
+    evhttp_send_reply(r->req, 200, "OK", buf);
+    free(r);
+}
+
+static void beacon_json(struct evhttp_request *req, void *arg)
+/* Built over as many loop turns as the table takes, so a large one
+   doesn't stall ingest */
+{
     UNUSED(arg);
-    json_object *b_array = json_object_new_array();
+    beacon_json_req_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    r->req = req;
+    r->evcon = evhttp_request_get_connection(req);
+    r->b_array = json_object_new_array();
+    struct event_base *base = evhttp_connection_get_base(r->evcon);
+    if (!(r->slicer = beacon_walk_sliced(base, beacon_json_slice_walker,
+                                         beacon_json_done, r))) {
+        json_object_put(r->b_array);
+        free(r);
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    evhttp_connection_set_closecb(r->evcon, beacon_json_closecb, r);
+}
 
-    walker_cb func[1] = {beacon_hash_walker};
-    void *args[1] = {b_array};
+static void stats_json(struct evhttp_request *req, void *arg) {
+    UNUSED(arg);
+    json_object *jobj = json_object_new_object();
+
+    ingest_stats_t const *is = ingest_get_stats();
+    json_object *ingest = json_object_new_object();
+    json_object_object_add(
+        ingest, "backend",
+        json_object_new_string(ingest_backend_name(is->backend)));
+    json_object_object_add(ingest, "syscalls",
+                           json_object_new_int64(is->syscalls));
+    json_object_object_add(ingest, "events",
+                           json_object_new_int64(is->events));
+    json_object_object_add(ingest, "stamped",
+                           json_object_new_int64(is->stamped));
+    json_object_object_add(
+        ingest, "events_per_syscall",
+        json_object_new_double(is->syscalls ? (double)is->events / is->syscalls
+                                            : 0));
+    if (is->backend == INGEST_BACKEND_THREAD) {
+        json_object_object_add(ingest, "ring_size",
+                               json_object_new_int64(is->ring_size));
+        json_object_object_add(ingest, "ring_occupancy",
+                               json_object_new_int64(is->ring_occupancy));
+        json_object_object_add(ingest, "ring_high_water",
+                               json_object_new_int64(is->ring_high_water));
+        json_object_object_add(ingest, "ring_overflows",
+                               json_object_new_int64(is->ring_overflows));
+        json_object_object_add(ingest, "adapters_lost",
+                               json_object_new_int64(is->adapters_lost));
+    }
+    json_object_object_add(jobj, "ingest", ingest);
+
+    accept_list_stats_t const *as = accept_list_get_stats();
+    json_object *accept = json_object_new_object();
+    json_object_object_add(accept, "enabled",
+                           json_object_new_boolean(as->enabled));
+    json_object_object_add(accept, "learning",
+                           json_object_new_boolean(as->learning));
+    json_object_object_add(accept, "filter_policy",
+                           json_object_new_int(as->filter_policy));
+    json_object_object_add(accept, "controller_size",
+                           json_object_new_int(as->controller_size));
+    json_object_object_add(accept, "entries",
+                           json_object_new_int64(as->entries));
+    json_object_object_add(accept, "rejected",
+                           json_object_new_int64(as->rejected));
+    json_object_object_add(accept, "syncs", json_object_new_int64(as->syncs));
+    json_object_object_add(jobj, "accept_list", accept);
+
+    admission_stats_t const *ads = admission_get_stats();
+    json_object *admission = json_object_new_object();
+    json_object_object_add(admission, "enabled",
+                           json_object_new_boolean(ads->enabled));
+    json_object_object_add(admission, "sightings",
+                           json_object_new_int(ads->sightings));
+    json_object_object_add(admission, "admitted",
+                           json_object_new_int64(ads->admitted));
+    json_object_object_add(admission, "rejected",
+                           json_object_new_int64(ads->rejected));
+    json_object_object_add(jobj, "admission", admission);
+
+    distance_stats_t const *ds = distance_get_stats();
+    json_object *distance = json_object_new_object();
+    json_object_object_add(distance, "entries",
+                           json_object_new_int64(ds->entries));
+    json_object_object_add(distance, "delta_step",
+                           json_object_new_double(ds->delta_step));
+    json_object_object_add(distance, "rebuilds",
+                           json_object_new_int64(ds->rebuilds));
+    json_object_object_add(distance, "misses",
+                           json_object_new_int64(ds->misses));
+    json_object_object_add(jobj, "distance", distance);
+
+    beacon_stats_t const *bs = beacon_get_stats();
+    json_object *beacons = json_object_new_object();
+    json_object_object_add(beacons, "ibeacons",
+                           json_object_new_int64(bs->ibeacons));
+    json_object_object_add(beacons, "sbeacons",
+                           json_object_new_int64(bs->sbeacons));
+    json_object_object_add(beacons, "slots", json_object_new_int64(bs->slots));
+    json_object_object_add(beacons, "uuids", json_object_new_int64(bs->uuids));
+    json_object_object_add(beacons, "allocs",
+                           json_object_new_int64(bs->allocs));
+    json_object_object_add(beacons, "live",
+                           json_object_new_int64(bs->pool.live));
+    json_object_object_add(beacons, "free",
+                           json_object_new_int64(bs->pool.free));
+    json_object_object_add(beacons, "high_water",
+                           json_object_new_int64(bs->pool.high_water));
+    json_object_object_add(beacons, "bytes",
+                           json_object_new_int64(bs->pool.bytes));
+    json_object_object_add(beacons, "refused",
+                           json_object_new_int64(bs->pool.failures));
+    json_object_object_add(beacons, "expired",
+                           json_object_new_int64(bs->expired));
+    json_object_object_add(beacons, "capacity",
+                           json_object_new_int64(bs->capacity));
+    json_object_object_add(beacons, "occupancy",
+                           json_object_new_double(bs->occupancy));
+    json_object_object_add(beacons, "oldest_age",
+                           json_object_new_double(bs->oldest_age));
+    json_object_object_add(beacons, "evicted",
+                           json_object_new_int64(bs->evicted));
+    json_object_object_add(beacons, "unflushed",
+                           json_object_new_int64(bs->unflushed));
+    json_object_object_add(beacons, "slices",
+                           json_object_new_int64(bs->slices));
+    json_object_object_add(jobj, "beacons", beacons);
+
+    /* Per filter profile, the tuning and how its innovations behave
+       since it came into force */
+    config_params_t const *params = config_params();
+    json_object *kalman = json_object_new_array();
+    for (size_t i = 0; i < params->kalman_profiles; i++) {
+        kalman_profile_t const *p = &params->kalman[i];
+        kalman_innovation_t const *in = &beacon_filters()->innovation[i];
+        double const n = in->updates ? in->updates : 1;
+        json_object *profile = json_object_new_object();
+        if (i == KALMAN_PROFILE_IBEACON) {
+            json_object_object_add(profile, "profile",
+                                   json_object_new_string("ibeacon"));
+        } else if (i == KALMAN_PROFILE_SECURE) {
+            json_object_object_add(profile, "profile",
+                                   json_object_new_string("secure"));
+        } else {
+            char *uuid = hexlify(params->kalman_uuid[i], 16);
+            json_object_object_add(profile, "profile",
+                                   json_object_new_string(uuid));
+            free(uuid);
+        }
+        json_object_object_add(profile, "process_noise",
+                               json_object_new_double(p->q));
+        json_object_object_add(profile, "measurement_variance",
+                               json_object_new_double(p->r));
+        json_object_object_add(profile, "adaptive",
+                               json_object_new_boolean(p->alpha > 0));
+        json_object_object_add(profile, "gate_sigma",
+                               json_object_new_double(p->gate));
+        json_object_object_add(
+            profile, "gate_action",
+            json_object_new_string(p->gate_drop ? "discard" : "downweight"));
+        json_object_object_add(profile, "updates",
+                               json_object_new_int64(in->updates));
+        json_object_object_add(profile, "gated",
+                               json_object_new_int64(in->gated));
+        json_object_object_add(profile, "innovation_mean",
+                               json_object_new_double(in->sum / n));
+        json_object_object_add(profile, "innovation_rms",
+                               json_object_new_double(sqrt(in->sum_sq / n)));
+        json_object_object_add(profile, "nis",
+                               json_object_new_double(in->sum_nis / n));
+        json_object_object_add(profile, "measurement_variance_used",
+                               json_object_new_double(in->sum_r / n));
+        json_object_array_add(kalman, profile);
+    }
+    json_object_object_add(jobj, "kalman", kalman);
+
+    ble_filter_stats_t const *fs = ble_get_filter_stats();
+    double const steps = fs->steps ? fs->steps : 1;
+    json_object *filter = json_object_new_object();
+    json_object_object_add(filter, "updates",
+                           json_object_new_int64(fs->updates));
+    json_object_object_add(filter, "gated", json_object_new_int64(fs->gated));
+    json_object_object_add(filter, "distance_step_mean",
+                           json_object_new_double(fs->step_sum / steps));
+    json_object_object_add(filter, "distance_step_rms",
+                           json_object_new_double(sqrt(fs->step_sq / steps)));
+    json_object_object_add(filter, "distance_jumps",
+                           json_object_new_int64(fs->jumps));
+    json_object_object_add(jobj, "filter", filter);
+
+    snapshot_stats_t const *ss = snapshot_get_stats();
+    json_object *snapshot = json_object_new_object();
+    json_object_object_add(snapshot, "saves",
+                           json_object_new_int64(ss->saves));
+    json_object_object_add(snapshot, "failures",
+                           json_object_new_int64(ss->failures));
+    json_object_object_add(snapshot, "saved",
+                           json_object_new_int64(ss->saved));
+    json_object_object_add(snapshot, "bytes",
+                           json_object_new_int64(ss->bytes));
+    json_object_object_add(snapshot, "save_sec",
+                           json_object_new_double(ss->save_sec));
+    json_object_object_add(snapshot, "restored",
+                           json_object_new_int64(ss->restored));
+    json_object_object_add(snapshot, "stale",
+                           json_object_new_int64(ss->stale));
+    json_object_object_add(jobj, "snapshot", snapshot);
 
-    hash_walk(func, args, 1);
     struct evbuffer *buf = evhttp_request_get_output_buffer(req);
-    const char *json = json_object_to_json_string(b_array);
-    evbuffer_add_printf(buf, "%s", json);
-    json_object_put(b_array);
+    const char *json = json_object_to_json_string(jobj);
+    evbuffer_add(buf, json, strlen(json));
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       "application/json");
     evhttp_send_reply(req, 200, "OK", buf);
+    json_object_put(jobj);
 }
 
 struct url_map_s {
@@ -281,6 +534,7 @@ struct url_map_s {
     {"/json/network.json", network_json},
     {"/json/network_status.json", network_status_json},
     {"/json/beacons.json", beacon_json},
+    {"/json/stats.json", stats_json},
     {NULL, NULL},
 };
 
@@ -0,0 +1,439 @@
+/* ingest.c - Moving HCI event packets from the scan socket to the
+ * parser.
+ *
+ *   The bufferevent backend is the original path: libevent reads into
+ *   an evbuffer and ble_readcb carves events back out of the stream.
+ *
+ *   The recvmmsg backend relies on the raw HCI socket preserving
+ *   packet boundaries; each datagram is exactly one HCI event, so a
+ *   single recvmmsg drains up to INGEST_BATCH_SIZE events into fixed
+ *   buffers which are parsed in place as one batch.
+ *
+ *   The thread backend does the recvmmsg reads on a dedicated thread
+ *   so a slow HTTP request or DNS lookup on the event loop can't let
+ *   the socket overflow. Packets are received straight into the slots
+ *   of a single-producer/single-consumer ring; the event loop is woken
+ *   through an eventfd and parses whatever has accumulated in batches.
+ *   The ring indices are free running and only ever written by one
+ *   side each, so no locks are needed. When the ring fills, the thread
+ *   waits INGEST_RING_WAIT_MS for room, then drops one packet at a
+ *   time so the loss is counted; the rest waits in the socket.
+ *
+ *   Both datagram backends take each event's arrival time from the
+ *   kernel (HCI_CMSG_TSTAMP) rather than from the clock when it is
+ *   read, so a busy loop doesn't skew the filters' dt. Those stamps
+ *   are wall clock and are mapped onto the monotonic clock with an
+ *   offset refreshed every INGEST_CLOCK_SYNC_SEC. The bufferevent
+ *   backend reads a byte stream with no ancillary data and stamps
+ *   events when they are parsed.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "ble.h"
+#include "config.h"
+#include "ingest.h"
+#include "log.h"
+#include "time_util.h"
+
+static ingest_stats_t ingest_stats = {0};
+
+static uint8_t pkt_buf[INGEST_BATCH_SIZE][HCI_MAX_EVENT_SIZE];
+static struct iovec pkt_iov[INGEST_BATCH_SIZE];
+static struct mmsghdr pkt_msg[INGEST_BATCH_SIZE];
+static uint8_t pkt_cmsg[INGEST_BATCH_SIZE][INGEST_CMSG_SPACE]
+    __attribute__((aligned(sizeof(size_t))));
+
+typedef struct ingest_slot {
+    double ts; /* Wall clock when stamped, time_now() otherwise */
+    uint16_t len;
+    uint8_t adapter;
+    bool stamped;
+    uint8_t data[HCI_MAX_EVENT_SIZE];
+} ingest_slot_t;
+
+static ingest_slot_t ring[INGEST_RING_SLOTS];
+/* Free running; head is written by the ingest thread only and tail by
+   the event loop only */
+static unsigned long ring_head = 0, ring_tail = 0;
+/* Counters kept by the ingest thread, word sized so they are lock-free
+   everywhere */
+static unsigned long ring_overflows = 0, ring_high_water = 0;
+static unsigned long ring_syscalls = 0, ring_events = 0;
+static unsigned long ring_stamped = 0, ring_lost = 0;
+static int ring_efd = -1;
+
+#define RING_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define RING_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#define RING_COUNT(v, x) __atomic_fetch_add(&(v), (x), __ATOMIC_RELAXED)
+
+ingest_stats_t const *ingest_get_stats(void) {
+    if (ingest_stats.backend == INGEST_BACKEND_THREAD) {
+        ingest_stats.syscalls =
+            __atomic_load_n(&ring_syscalls, __ATOMIC_RELAXED);
+        ingest_stats.events = __atomic_load_n(&ring_events, __ATOMIC_RELAXED);
+        ingest_stats.stamped =
+            __atomic_load_n(&ring_stamped, __ATOMIC_RELAXED);
+        ingest_stats.adapters_lost = RING_LOAD(ring_lost);
+        ingest_stats.ring_overflows =
+            __atomic_load_n(&ring_overflows, __ATOMIC_RELAXED);
+        ingest_stats.ring_high_water =
+            __atomic_load_n(&ring_high_water, __ATOMIC_RELAXED);
+        ingest_stats.ring_occupancy = RING_LOAD(ring_head) - ring_tail;
+    }
+    return &ingest_stats;
+}
+
+const char *ingest_backend_name(enum ingest_backend backend) {
+    switch (backend) {
+    case INGEST_BACKEND_RECVMMSG:
+        return "recvmmsg";
+    case INGEST_BACKEND_THREAD:
+        return "thread";
+    case INGEST_BACKEND_BUFFEREVENT:
+    default:
+        return "bufferevent";
+    }
+}
+
+static void ingest_msg_prepare(struct msghdr *m, struct iovec *iov,
+                               uint8_t *ctl, void *buf, size_t len)
+/* recvmmsg rewrites msg_controllen, so this is redone for every read */
+{
+    m->msg_iov = iov;
+    m->msg_iovlen = 1;
+    m->msg_control = ctl;
+    m->msg_controllen = INGEST_CMSG_SPACE;
+    iov->iov_base = buf;
+    iov->iov_len = len;
+}
+
+static bool ingest_msg_stamp(struct msghdr *m, double *real)
+/* The kernel receive time of a packet, wall clock, if it has one */
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(m); c; c = CMSG_NXTHDR(m, c)) {
+        if (c->cmsg_level == SOL_HCI && c->cmsg_type == HCI_CMSG_TSTAMP &&
+            c->cmsg_len >= CMSG_LEN(sizeof(ingest_kernel_tv_t))) {
+            ingest_kernel_tv_t tv;
+            memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+            *real = tv.s + tv.us / 1E6;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ingest_clock_sync(evutil_socket_t fd, short what, void *arg) {
+    UNUSED(fd);
+    UNUSED(what);
+    UNUSED(arg);
+    time_sync_realtime();
+}
+
+static void ingest_bufferevent_readcb(struct bufferevent *bev, void *ptr) {
+    ble_adapter_t const *a = ptr;
+    /* libevent issues one read per wakeup before calling us */
+    ingest_stats.syscalls++;
+    ingest_stats.events += ble_readcb(bev, a->idx);
+}
+
+static void ingest_recvmmsg_cb(evutil_socket_t fd, short what, void *arg) {
+    UNUSED(what);
+    ble_adapter_t const *a = arg;
+    ble_pkt_t batch[INGEST_BATCH_SIZE];
+    int n;
+
+    do {
+        for (size_t i = 0; i < INGEST_BATCH_SIZE; i++) {
+            ingest_msg_prepare(&pkt_msg[i].msg_hdr, &pkt_iov[i], pkt_cmsg[i],
+                               pkt_buf[i], sizeof(pkt_buf[i]));
+        }
+        n = recvmmsg(fd, pkt_msg, INGEST_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        ingest_stats.syscalls++;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("Failed to read HCI socket: %s", strerror(errno));
+            }
+            return;
+        }
+        /* Only read the clock if some event came without a stamp */
+        double now = 0;
+        for (int i = 0; i < n; i++) {
+            double real;
+            if (ingest_msg_stamp(&pkt_msg[i].msg_hdr, &real)) {
+                batch[i].ts = time_from_realtime(real);
+                ingest_stats.stamped++;
+            } else {
+                batch[i].ts = now ? now : (now = time_now());
+            }
+            batch[i].data = pkt_buf[i];
+            batch[i].len = pkt_msg[i].msg_len;
+            batch[i].adapter = a->idx;
+        }
+        ingest_stats.events += n;
+        ble_parse_batch(batch, n);
+        /* A full batch means there is probably more queued */
+    } while (n == INGEST_BATCH_SIZE);
+}
+
+static int ingest_thread_read(ble_adapter_t const *a, bool drop)
+/* Receive as many packets as fit into the free part of the ring,
+   returns the number published, 0 if the ring is full or -1 once the
+   socket is drained. With drop, one packet that doesn't fit is read
+   and counted as lost */
+{
+    static struct iovec iov[INGEST_BATCH_SIZE];
+    static struct mmsghdr msg[INGEST_BATCH_SIZE];
+    static uint8_t ctl[INGEST_BATCH_SIZE][INGEST_CMSG_SPACE]
+        __attribute__((aligned(sizeof(size_t))));
+    static uint8_t discard[HCI_MAX_EVENT_SIZE];
+    unsigned long head = ring_head;
+    unsigned long used = head - RING_LOAD(ring_tail);
+    size_t room = INGEST_RING_SLOTS - used;
+    size_t k = room < INGEST_BATCH_SIZE ? room : INGEST_BATCH_SIZE;
+
+    if (k == 0) {
+        if (!drop) {
+            return 0;
+        }
+        /* The event loop has fallen behind. Drop a packet here so
+           the loss is counted */
+        ssize_t r = recv(a->dd, discard, sizeof(discard), MSG_DONTWAIT);
+        RING_COUNT(ring_syscalls, 1);
+        if (r < 0) {
+            return -1;
+        }
+        RING_COUNT(ring_overflows, 1);
+        return 0;
+    }
+    for (size_t i = 0; i < k; i++) {
+        ingest_slot_t *slot = &ring[(head + i) % INGEST_RING_SLOTS];
+        ingest_msg_prepare(&msg[i].msg_hdr, &iov[i], ctl[i], slot->data,
+                           sizeof(slot->data));
+    }
+    int n = recvmmsg(a->dd, msg, k, MSG_DONTWAIT, NULL);
+    RING_COUNT(ring_syscalls, 1);
+    if (n <= 0) {
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            log_error("Failed to read HCI socket: %s", strerror(errno));
+        }
+        return -1;
+    }
+    /* The wall clock offset belongs to the event loop; stamps are
+       converted there */
+    double now = 0;
+    unsigned long stamped = 0;
+    for (int i = 0; i < n; i++) {
+        ingest_slot_t *slot = &ring[(head + i) % INGEST_RING_SLOTS];
+        slot->stamped = ingest_msg_stamp(&msg[i].msg_hdr, &slot->ts);
+        if (slot->stamped) {
+            stamped++;
+        } else {
+            slot->ts = now ? now : (now = time_now());
+        }
+        slot->len = msg[i].msg_len;
+        slot->adapter = a->idx;
+    }
+    RING_STORE(ring_head, head + n);
+    RING_COUNT(ring_events, n);
+    RING_COUNT(ring_stamped, stamped);
+    if (used + n > ring_high_water) {
+        __atomic_store_n(&ring_high_water, used + n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+static void ingest_thread_wake(void) {
+    uint64_t one = 1;
+    if (write(ring_efd, &one, sizeof(one)) < 0) {
+        log_error("Failed to wake event loop: %s", strerror(errno));
+    }
+}
+
+static void *ingest_thread_main(void *arg) {
+    UNUSED(arg);
+    struct pollfd fds[BLE_MAX_ADAPTERS];
+    size_t nfds = ble_adapter_count();
+    for (size_t i = 0; i < nfds; i++) {
+        fds[i].fd = ble_get_adapter(i)->dd;
+        fds[i].events = POLLIN;
+    }
+    while (1) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR) {
+                log_error("Ingest thread poll failed: %s", strerror(errno));
+            }
+            continue;
+        }
+        int published = 0;
+        bool lost = false;
+        for (size_t i = 0; i < nfds; i++) {
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                /* Unplugged or reset; poll would keep returning at
+                   once for it, so stop watching it */
+                log_error("HCI socket of hci%d failed, no longer reading it",
+                          ble_get_adapter(i)->dev_id);
+                fds[i].fd = -1;
+                RING_COUNT(ring_lost, 1);
+                lost = true;
+                continue;
+            }
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            int n;
+            bool waited = false;
+            while ((n = ingest_thread_read(ble_get_adapter(i), waited)) >= 0) {
+                if (n > 0) {
+                    published += n;
+                    waited = false;
+                    continue;
+                }
+                if (waited) {
+                    /* One dropped; the rest stays in the socket buffer
+                       until the event loop has room again */
+                    break;
+                }
+                /* Ring full: make sure the event loop is draining it
+                   and give it a moment before dropping anything */
+                if (published) {
+                    ingest_thread_wake();
+                    published = 0;
+                }
+                poll(NULL, 0, INGEST_RING_WAIT_MS);
+                waited = true;
+            }
+        }
+        if (published || lost) {
+            ingest_thread_wake();
+        }
+    }
+    return NULL;
+}
+
+static void ingest_ring_cb(evutil_socket_t fd, short what, void *arg)
+/* Event loop side; parse everything the ingest thread has queued */
+{
+    UNUSED(what);
+    UNUSED(arg);
+    uint64_t wakeups;
+    ble_pkt_t batch[INGEST_BATCH_SIZE];
+
+    if (read(fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        log_error("Failed to read ingest eventfd: %s", strerror(errno));
+    }
+    /* Only the parent could reopen the adapters; with none left, shut
+       down and let the supervisor restart us */
+    static bool shutting_down = false;
+    if (!shutting_down && RING_LOAD(ring_lost) >= ble_adapter_count()) {
+        log_error("No HCI adapters left to read, shutting down");
+        shutting_down = true;
+        raise(SIGTERM);
+    }
+    unsigned long head = RING_LOAD(ring_head);
+    while (ring_tail != head) {
+        size_t n = 0;
+        while (n < INGEST_BATCH_SIZE && ring_tail + n != head) {
+            ingest_slot_t *slot = &ring[(ring_tail + n) % INGEST_RING_SLOTS];
+            batch[n].data = slot->data;
+            batch[n].len = slot->len;
+            batch[n].ts =
+                slot->stamped ? time_from_realtime(slot->ts) : slot->ts;
+            batch[n].adapter = slot->adapter;
+            n++;
+        }
+        ble_parse_batch(batch, n);
+        /* Only now may the ingest thread reuse the slots */
+        RING_STORE(ring_tail, ring_tail + n);
+    }
+}
+
+static int ingest_thread_start(struct event_base *base) {
+    pthread_t thread;
+    ingest_stats.ring_size = INGEST_RING_SLOTS;
+    if ((ring_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        log_error("Failed to create ingest eventfd: %s", strerror(errno));
+        return -1;
+    }
+    struct event *ev =
+        event_new(base, ring_efd, EV_READ | EV_PERSIST, ingest_ring_cb, NULL);
+    if (!ev || event_add(ev, NULL) < 0) {
+        log_error("Failed to register ingest eventfd with event loop");
+        return -1;
+    }
+    /* The ingest thread polls the (non-blocking) scan sockets itself */
+    if ((errno = pthread_create(&thread, NULL, ingest_thread_main, NULL))) {
+        log_error("Failed to start ingest thread: %s", strerror(errno));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+static int ingest_start_adapter(struct event_base *base,
+                                ble_adapter_t const *a,
+                                enum ingest_backend backend) {
+    if (backend == INGEST_BACKEND_RECVMMSG) {
+        struct event *ev = event_new(base, a->dd, EV_READ | EV_PERSIST,
+                                     ingest_recvmmsg_cb, (void *)a);
+        if (!ev || event_add(ev, NULL) < 0) {
+            log_error("Failed to register HCI socket with event loop");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Setup a bufferevent to process BLE scan results */
+    struct bufferevent *ble_bev = bufferevent_socket_new(base, a->dd, 0);
+    if (!ble_bev) {
+        log_error("Failed to create HCI bufferevent");
+        return -1;
+    }
+    bufferevent_setcb(ble_bev, ingest_bufferevent_readcb, NULL, NULL,
+                      (void *)a);
+    bufferevent_enable(ble_bev, EV_READ);
+    bufferevent_setwatermark(ble_bev, EV_READ, sizeof(ble_report_hdr_t), 0);
+    return 0;
+}
+
+int ingest_start(struct event_base *base, enum ingest_backend backend)
+/* Start reading every adapter opened by ble_init; each socket is
+   drained independently so throughput scales with adapters */
+{
+    ingest_stats.backend = backend;
+    log_notice("HCI ingest backend: %s", ingest_backend_name(backend));
+    if (backend != INGEST_BACKEND_BUFFEREVENT) {
+        time_sync_realtime();
+        struct event *ev =
+            event_new(base, -1, EV_PERSIST, ingest_clock_sync, NULL);
+        struct timeval tv = {INGEST_CLOCK_SYNC_SEC, 0};
+        if (!ev || evtimer_add(ev, &tv) < 0) {
+            log_error("Failed to schedule HCI timestamp clock sync");
+            return -1;
+        }
+    }
+    if (backend == INGEST_BACKEND_THREAD) {
+        return ingest_thread_start(base);
+    }
+    for (size_t i = 0; i < ble_adapter_count(); i++) {
+        if (ingest_start_adapter(base, ble_get_adapter(i), backend) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
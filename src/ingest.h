@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+#define INGEST_BATCH_SIZE 32 /* HCI packets drained per recvmmsg */
+#define INGEST_RING_SLOTS                                                      \
+    512 /* Packets buffered between the ingest                                 \
+           thread and the event loop */
+#define INGEST_RING_WAIT_MS 1 /* Grace for the event loop on a full ring */
+#define INGEST_CLOCK_SYNC_SEC 1 /* Wall clock offset refresh for stamps */
+/* HCI_CMSG_TSTAMP as the kernel writes it, a __kernel_old_timeval of
+   two longs whatever the C library's time_t */
+typedef struct ingest_kernel_tv {
+    long s, us;
+} ingest_kernel_tv_t;
+/* Ancillary data room for one kernel receive timestamp */
+#define INGEST_CMSG_SPACE CMSG_SPACE(sizeof(ingest_kernel_tv_t))
+
+enum ingest_backend {
+    INGEST_BACKEND_BUFFEREVENT = 0,
+    INGEST_BACKEND_RECVMMSG,
+    INGEST_BACKEND_THREAD,
+};
+
+typedef struct ingest_stats {
+    enum ingest_backend backend;
+    uint64_t syscalls; /* Reads issued against the HCI socket */
+    uint64_t events;   /* HCI event packets handed to the parser */
+    uint64_t stamped;  /* Events carrying a kernel receive timestamp */
+    /* Thread backend only */
+    size_t ring_size;
+    size_t ring_occupancy;  /* Packets waiting for the event loop */
+    size_t ring_high_water;
+    uint64_t ring_overflows; /* Packets dropped because the ring was full */
+    size_t adapters_lost;    /* Sockets given up on after an error/hangup */
+} ingest_stats_t;
+
+int ingest_start(struct event_base *, enum ingest_backend);
+ingest_stats_t const *ingest_get_stats(void);
+const char *ingest_backend_name(enum ingest_backend);
@@ -16,6 +16,7 @@
 
 #include <json-c/json.h>
 
+#include "accept_list.h"
 #include "config.h"
 #include "ipc-privileged.h"
 #include "ipc.h"
@@ -28,6 +29,7 @@ enum {
     CONFIG_NOT_FOUND = 1,
     IPC_UNKNOWN_CMD,
     IPC_REBOOT_FAILED,
+    IPC_ACCEPT_LIST_APPLIED,
 };
 
 const char *uci_settings[] = {"proto", "ipaddr", "netmask", "gateway",
@@ -104,6 +106,7 @@ void ipc_parent_readcb(struct bufferevent *bev, void *ctx) {
             int cmd = l->entries[i]->cmd;
             char *key = l->entries[i]->key, *val = l->entries[i]->val;
             int rv;
+            uint8_t filter_policy = 0;
             /* Dispatch the commands */
             switch (cmd) {
             case IPC_CMD_SET:
@@ -115,6 +118,11 @@ void ipc_parent_readcb(struct bufferevent *bev, void *ctx) {
                             &((struct timeval){5, 0}));
                 rv = IPC_REBOOTING;
                 break;
+            case IPC_CMD_ACCEPT_LIST:
+                /* The child can't send LE commands without CAP_NET_RAW */
+                filter_policy = accept_list_apply(key, val);
+                rv = IPC_ACCEPT_LIST_APPLIED;
+                break;
             default:
                 rv = IPC_UNKNOWN_CMD;
                 break;
@@ -129,6 +137,13 @@ void ipc_parent_readcb(struct bufferevent *bev, void *ctx) {
                     r->status = IPC_ABORT;
                 }
                 break;
+            case IPC_ACCEPT_LIST_APPLIED:
+                r->code = 200;
+                r->status = IPC_SUCCESS;
+                if (asprintf(&r->resp, "%u", filter_policy) < 0) {
+                    r->status = IPC_ABORT;
+                }
+                break;
             case IPC_UNKNOWN_CMD:
                 r->code = 503;
                 if (asprintf(&r->resp, "Unknown IPC Command %d\n", cmd)) {
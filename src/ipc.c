@@ -10,6 +10,7 @@
 
 #include <sys/queue.h>
 
+#include "accept_list.h"
 #include "config.h"
 #include "http.h"
 #include "ipc.h"
@@ -173,6 +174,20 @@ void ipc_child_readcb(struct bufferevent *bev, void *ctx) {
             return;
         }
 
+        /* Accept list updates the parent made on our behalf */
+        if (accept_list_pending(ipc_resp_buf.serial)) {
+            size_t resp_len = sizeof(ipc_resp_t) + ipc_resp_buf.resp_l;
+            if (evbuffer_get_length(input) < resp_len) {
+                bufferevent_setwatermark(bev, EV_READ, resp_len, 0);
+                return;
+            }
+            bufferevent_setwatermark(bev, EV_READ, sizeof(ipc_resp_t), 0);
+            r = ipc_resp_fetch_alloc(bev);
+            accept_list_applied(r->resp);
+            ipc_resp_free(r);
+            continue;
+        }
+
         /* Find the pending web request */
         struct http_req *hreq = NULL;
         struct evhttp_request *req = NULL;
@@ -221,6 +236,9 @@ void ipc_child_readcb(struct bufferevent *bev, void *ctx) {
                 if (r->status == IPC_ERROR) {
                     evhttp_send_error(req, r->code, r->resp);
                 } else if (r->status == IPC_SUCCESS) {
+                    /* The parent has written the change out; pick it
+                       up so it applies without a restart */
+                    config_refresh();
                     http_set_reset_req();
                     evhttp_send_reply(req, r->code, r->resp, NULL);
                 } else {
@@ -330,3 +348,9 @@ ipc_cmd_t *ipc_cmd_set(const char *key, const char *val) {
     memcpy(c->val, val, c->val_l);
     return c;
 }
+
+ipc_cmd_t *ipc_cmd_accept_list(const char *policy, const char *addrs) {
+    ipc_cmd_t *c = ipc_cmd_set(policy, addrs);
+    c->cmd = IPC_CMD_ACCEPT_LIST;
+    return c;
+}
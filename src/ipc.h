@@ -56,6 +56,7 @@ enum ipc_commands {
     IPC_CMD_RESTART = 0, /* Reset router, no args */
     IPC_CMD_GET,
     IPC_CMD_SET,
+    IPC_CMD_ACCEPT_LIST, /* Load the controller filter, policy=addrs */
 };
 
 void ipc_child_readcb(struct bufferevent *, void *);
@@ -75,3 +76,4 @@ void ipc_cmd_list_free(ipc_cmd_list_t *);
 struct evbuffer *ipc_cmd_flatten(ipc_cmd_t *);
 ipc_cmd_t *ipc_cmd_recover(struct evbuffer *);
 ipc_cmd_t *ipc_cmd_restart(void);
+ipc_cmd_t *ipc_cmd_accept_list(const char *, const char *);
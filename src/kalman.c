@@ -12,61 +12,362 @@
 
 /** Kalman Filter **/
 
-double kalman(void *b, int8_t z, double ts) {
-    hashable_filterable_t *v = b;
-    kalman_t *f = &v->kalman;
-    if (!f->init) {
-        f->state[0] = z;
-        /* Initial covariance calibrated via usb dongle and dev board */
-        f->P[0][0] = 1.2;
-        f->P[0][1] = 0.45;
-        f->P[1][0] = 0.45;
-        f->P[1][1] = 0.34;
-        f->last_seen = ts;
-        f->init = true;
-        return (double)z;
-    }
-    double dt = ts - f->last_seen;
-    f->last_seen = ts;
-    // log_stdout("delta-T: %f; b->last_seen: %f; now: %f\n", dt, b->last_seen,
-    // ts);
+static inline void kalman_step(double *x0, double *x1, double *p00,
+                               double *p01, double *p10, double *p11,
+                               double *last_seen, float *nu2,
+                               uint8_t *outliers, double q,
+                               double *r, double alpha, double gate2,
+                               bool drop, int8_t z, double ts, double *innov,
+                               double *innov_var, bool *gated)
+/* One predict/update of an initialised filter. kalman() and the
+   filter store run the very same code, so both give the same results.
+   r is the profile's measurement variance going in and, before any
+   gating, the one used coming out, along with the innovation, its
+   predicted variance and whether it was an outlier */
+{
+    double dt = ts - *last_seen;
+    /* With several adapters, reports of one beacon can be processed
+       slightly out of order; fuse a late measurement as if it were
+       simultaneous rather than predicting backwards */
+    bool const late = dt < 0;
+    *last_seen = late ? *last_seen : ts;
+    dt = late ? 0 : dt;
     /* Process noise matrix Q is generated per packet to account for
        variable dt */
     p_noise_t Q;
-    Q[0][0] = Q_SPECTRAL_DENSITY * dt * dt * dt / 3;
-    Q[0][1] = Q_SPECTRAL_DENSITY * dt * dt / 2;
-    Q[1][0] = Q_SPECTRAL_DENSITY * dt * dt / 2;
-    Q[1][1] = Q_SPECTRAL_DENSITY * dt;
-    // log_stdout("Q11=%f, Q12=%f, Q21=%f, Q22=%f\n", Q[0][0], Q[0][1], Q[1][0],
-    // Q[1][1]);
+    Q[0][0] = q * dt * dt * dt / 3;
+    Q[0][1] = q * dt * dt / 2;
+    Q[1][0] = q * dt * dt / 2;
+    Q[1][1] = q * dt;
     /* Predict */
     /** Project state **/
     state_t state_est;
-    state_est[0] = f->state[0] + f->state[1] * dt;
-    state_est[1] = f->state[1];
+    state_est[0] = *x0 + *x1 * dt;
+    state_est[1] = *x1;
     /** Project covariance **/
     covariance_t P_est;
-    P_est[0][0] = f->P[0][0] + (f->P[1][0] + f->P[0][1]) * dt +
-                  f->P[1][1] * dt * dt + Q[0][0];
-    P_est[0][1] = f->P[0][1] + f->P[1][1] * dt + Q[0][1];
-    P_est[1][0] = f->P[1][0] + f->P[1][1] * dt + Q[1][0];
-    P_est[1][1] = f->P[1][1] + Q[1][1];
-    // log_stdout("P_est11=%f, P_est12=%f, P_est21=%f, P_est22=%f\n",
-    // P_est[0][0], P_est[0][1], P_est[1][0], P_est[1][1]);
+    P_est[0][0] = *p00 + (*p10 + *p01) * dt + *p11 * dt * dt + Q[0][0];
+    P_est[0][1] = *p01 + *p11 * dt + Q[0][1];
+    P_est[1][0] = *p10 + *p11 * dt + Q[1][0];
+    P_est[1][1] = *p11 + Q[1][1];
     /* Update */
+    /** Adapt R: the innovation's variance is P_est[0][0] + R, so R is
+        what the running mean square innovation leaves over P_est **/
+    double const r_est = *nu2 - P_est[0][0];
+    double const r_lo = *r / KALMAN_ADAPTIVE_RANGE;
+    double const r_hi = *r * KALMAN_ADAPTIVE_RANGE;
+    double const R =
+        alpha > 0 ? (r_est < r_lo ? r_lo : r_est > r_hi ? r_hi : r_est) : *r;
+    /** Gate: an outlier's R is scaled up so its normalised innovation
+        lands on the gate or, dropped, it gets no gain at all **/
+    double const nu = z - state_est[0];
+    double const nis = nu * nu / (P_est[0][0] + R);
+    bool const out =
+        gate2 > 0 && nis > gate2 && *outliers < KALMAN_GATE_RUN_MAX;
+    double const Rg = out ? R * nis / gate2 : R;
     /** Compute Kalman gain **/
     kgain_t K;
-    K[0] = P_est[0][0] / (P_est[0][0] + MEASUREMENT_VARIANCE);
-    K[1] = P_est[1][0] / (P_est[0][0] + MEASUREMENT_VARIANCE);
+    K[0] = out && drop ? 0 : P_est[0][0] / (P_est[0][0] + Rg);
+    K[1] = out && drop ? 0 : P_est[1][0] / (P_est[0][0] + Rg);
     /** Update state estimate **/
-    f->state[0] = K[0] * (z - state_est[0]) + state_est[0];
-    f->state[1] = K[1] * (z - state_est[0]) + state_est[1];
+    *x0 = K[0] * nu + state_est[0];
+    *x1 = K[1] * nu + state_est[1];
     /** Update covariance **/
-    f->P[0][0] = P_est[0][0] * (-K[0] + 1);
-    f->P[0][1] = P_est[0][1] * (-K[0] + 1);
-    f->P[1][0] = -P_est[0][0] * K[1] + P_est[1][0];
-    f->P[1][1] = -P_est[0][1] * K[1] + P_est[1][1];
-    // log_stdout("P11=%f, P12=%f, P21=%f, P22=%f\n", f->P[0][0], f->P[0][1],
-    // f->P[1][0], f->P[1][1]);
+    *p00 = P_est[0][0] * (-K[0] + 1);
+    *p01 = P_est[0][1] * (-K[0] + 1);
+    *p10 = -P_est[0][0] * K[1] + P_est[1][0];
+    *p11 = -P_est[0][1] * K[1] + P_est[1][1];
+    /* Outliers count toward the estimate of R only up to the gate */
+    double const nu_sq = out ? gate2 * (P_est[0][0] + R) : nu * nu;
+    *nu2 = (float)(*nu2 + alpha * (nu_sq - *nu2));
+    *r = R;
+    *innov = nu;
+    *innov_var = P_est[0][0] + R;
+    *outliers = out ? *outliers + 1 : 0;
+    *gated = out;
+}
+
+double kalman(kalman_t *f, kalman_profile_t const *prof, int8_t z,
+              double ts) {
+    if (!f->init) {
+        f->state[0] = z;
+        f->state[1] = 0;
+        f->P[0][0] = prof->p00;
+        f->P[0][1] = prof->p01;
+        f->P[1][0] = prof->p01;
+        f->P[1][1] = prof->p11;
+        f->nu2 = (float)(prof->r + prof->p00);
+        f->outliers = 0;
+        f->last_seen = ts;
+        f->init = true;
+        return (double)z;
+    }
+    double r = prof->r, innov, innov_var;
+    bool gated;
+    kalman_step(&f->state[0], &f->state[1], &f->P[0][0], &f->P[0][1],
+                &f->P[1][0], &f->P[1][1], &f->last_seen, &f->nu2,
+                &f->outliers, prof->q, &r, prof->alpha,
+                prof->gate * prof->gate, prof->gate_drop, z, ts, &innov,
+                &innov_var, &gated);
     return f->state[0];
 }
+
+static inline q16_t q16_mul(q16_t a, q16_t b) {
+    return (q16_t)(((int64_t)a * b + (1 << 15)) >> 16);
+}
+
+/* Largest squared innovation, and gated R, in the fixed point filter */
+#define KALMAN_FIXED_VAR_MAX Q16(16384.0)
+
+static inline void kalman_step_fixed(q16_t *x0, q16_t *x1, q16_t *p00,
+                                     q16_t *p01, q16_t *p10, q16_t *p11,
+                                     double *last_seen, q16_t *nu2,
+                                     uint8_t *outliers, q16_t q,
+                                     q16_t *r, q16_t alpha, q16_t gate2,
+                                     bool drop, int8_t z, double ts,
+                                     q16_t *innov, q16_t *innov_var,
+                                     bool *gated)
+/* kalman_step() in Q16.16: only dt goes through floating point, the
+   rest is 32 bit integer work with 64 bit products */
+{
+    double dt_sec = ts - *last_seen;
+    bool const late = dt_sec < 0;
+    *last_seen = late ? *last_seen : ts;
+    dt_sec = late ? 0 : dt_sec;
+    dt_sec = dt_sec > KALMAN_FIXED_DT_MAX ? KALMAN_FIXED_DT_MAX : dt_sec;
+    q16_t const dt = (q16_t)(dt_sec * Q16_ONE);
+    q16_t const dt2 = q16_mul(dt, dt), dt3 = q16_mul(dt2, dt);
+
+    /* Q, scaled before dividing to keep its precision */
+    q16_t const q00 = q16_mul(q, dt3) / 3;
+    q16_t const q01 = q16_mul(q, dt2) / 2;
+    q16_t const q11 = q16_mul(q, dt);
+
+    /* Predict */
+    q16_t const s0 = *x0 + q16_mul(*x1, dt);
+    q16_t const s1 = *x1;
+    q16_t const e00 =
+        *p00 + q16_mul(*p10 + *p01, dt) + q16_mul(*p11, dt2) + q00;
+    q16_t const e01 = *p01 + q16_mul(*p11, dt) + q01;
+    q16_t const e10 = *p10 + q16_mul(*p11, dt) + q01;
+    q16_t const e11 = *p11 + q11;
+
+    /* Adapt R as kalman_step() does */
+    q16_t const r_est = *nu2 - e00;
+    q16_t const r_lo = *r / (q16_t)KALMAN_ADAPTIVE_RANGE;
+    q16_t const r_hi = *r * (q16_t)KALMAN_ADAPTIVE_RANGE;
+    q16_t const R =
+        alpha > 0 ? (r_est < r_lo ? r_lo : r_est > r_hi ? r_hi : r_est) : *r;
+
+    /* Gate as kalman_step() does */
+    q16_t const nu = (q16_t)z * Q16_ONE - s0;
+    int64_t sq = ((int64_t)nu * nu + (1 << 15)) >> 16;
+    sq = sq > KALMAN_FIXED_VAR_MAX ? KALMAN_FIXED_VAR_MAX : sq;
+    int64_t nis = (sq << 16) / (e00 + R);
+    nis = nis > KALMAN_FIXED_VAR_MAX ? KALMAN_FIXED_VAR_MAX : nis;
+    bool const out =
+        gate2 > 0 && nis > gate2 && *outliers < KALMAN_GATE_RUN_MAX;
+    int64_t rg = out ? R * nis / gate2 : R;
+    rg = rg > KALMAN_FIXED_VAR_MAX ? KALMAN_FIXED_VAR_MAX : rg;
+    q16_t const Rg = (q16_t)rg;
+
+    /* Update; both gains from one division, 2^40 / (P + R) is
+       1 / (P + R) with 24 fractional bits */
+    int64_t const inv = ((int64_t)1 << 40) / (e00 + Rg);
+    q16_t const k0 =
+        out && drop ? 0 : (q16_t)(((int64_t)e00 * inv + (1 << 23)) >> 24);
+    q16_t const k1 =
+        out && drop ? 0 : (q16_t)(((int64_t)e10 * inv + (1 << 23)) >> 24);
+    *x0 = s0 + q16_mul(k0, nu);
+    *x1 = s1 + q16_mul(k1, nu);
+    *p00 = q16_mul(e00, Q16_ONE - k0);
+    *p01 = q16_mul(e01, Q16_ONE - k0);
+    *p10 = e10 - q16_mul(e00, k1);
+    *p11 = e11 - q16_mul(e01, k1);
+    q16_t const nu_sq = out ? q16_mul(gate2, e00 + R) : (q16_t)sq;
+    *nu2 += q16_mul(alpha, nu_sq - *nu2);
+    *r = R;
+    *innov = nu;
+    *innov_var = e00 + R;
+    *outliers = out ? *outliers + 1 : 0;
+    *gated = out;
+}
+
+double kalman_fixed(kalman_fixed_t *f, kalman_profile_t const *prof,
+                    int8_t z, double ts) {
+    if (!f->init) {
+        f->state[0] = (q16_t)z * Q16_ONE;
+        f->state[1] = 0;
+        f->P[0][0] = Q16(prof->p00);
+        f->P[0][1] = Q16(prof->p01);
+        f->P[1][0] = Q16(prof->p01);
+        f->P[1][1] = Q16(prof->p11);
+        f->nu2 = Q16(prof->r + prof->p00);
+        f->outliers = 0;
+        f->last_seen = ts;
+        f->init = true;
+        return (double)z;
+    }
+    q16_t r = Q16(prof->r), innov, innov_var;
+    bool gated;
+    kalman_step_fixed(&f->state[0], &f->state[1], &f->P[0][0], &f->P[0][1],
+                      &f->P[1][0], &f->P[1][1], &f->last_seen, &f->nu2,
+                      &f->outliers, Q16(prof->q), &r, Q16(prof->alpha),
+                      Q16(prof->gate * prof->gate), prof->gate_drop, z, ts,
+                      &innov, &innov_var, &gated);
+    return Q16_TO_DOUBLE(f->state[0]);
+}
+
+#ifdef KALMAN_FIXED
+#define KALMAN_NUM(x) Q16(x)
+#define KALMAN_NUM_TO_DOUBLE(x) Q16_TO_DOUBLE(x)
+#define KALMAN_NU2(x) Q16(x)
+#define kalman_store_step kalman_step_fixed
+#else
+#define KALMAN_NUM(x) (x)
+#define KALMAN_NUM_TO_DOUBLE(x) (x)
+#define KALMAN_NU2(x) ((float)(x))
+#define kalman_store_step kalman_step
+#endif
+
+static bool kalman_store_grow(kalman_store_t *s) {
+    size_t cap = s->cap ? 2 * s->cap : KALMAN_BATCH_MAX;
+    if (cap > UINT32_MAX) {
+        return false;
+    }
+    kalman_slot_t *slots = aligned_alloc(sizeof(kalman_slot_t),
+                                         cap * sizeof(kalman_slot_t));
+    uint32_t *free_slots = realloc(s->free_slots, cap * sizeof(uint32_t));
+    if (free_slots) {
+        s->free_slots = free_slots;
+    }
+    if (!slots || !free_slots) {
+        free(slots);
+        return false;
+    }
+    if (s->slots) {
+        memcpy(slots, s->slots, s->len * sizeof(kalman_slot_t));
+        free(s->slots);
+    }
+    s->slots = slots;
+    s->cap = cap;
+    return true;
+}
+
+int64_t kalman_store_alloc(kalman_store_t *s)
+/* A slot for a new, uninitialised filter; -1 if out of memory */
+{
+    uint32_t slot;
+    if (s->nfree) {
+        slot = s->free_slots[--s->nfree];
+    } else {
+        if (s->len == s->cap && !kalman_store_grow(s)) {
+            return -1;
+        }
+        slot = s->len++;
+    }
+    memset(&s->slots[slot], 0, sizeof(kalman_slot_t));
+    return slot;
+}
+
+void kalman_store_free(kalman_store_t *s, uint32_t slot) {
+    s->free_slots[s->nfree++] = slot;
+}
+
+void kalman_store_destroy(kalman_store_t *s) {
+    free(s->slots);
+    free(s->free_slots);
+    memset(s, 0, sizeof(*s));
+}
+
+void kalman_store_get(kalman_store_t const *s, uint32_t slot, kalman_t *f)
+/* Copy a filter out, as doubles whichever flavour the store is */
+{
+    kalman_slot_t const *k = &s->slots[slot];
+    f->state[0] = KALMAN_NUM_TO_DOUBLE(k->x0);
+    f->state[1] = KALMAN_NUM_TO_DOUBLE(k->x1);
+    f->P[0][0] = KALMAN_NUM_TO_DOUBLE(k->p00);
+    f->P[0][1] = KALMAN_NUM_TO_DOUBLE(k->p01);
+    f->P[1][0] = KALMAN_NUM_TO_DOUBLE(k->p10);
+    f->P[1][1] = KALMAN_NUM_TO_DOUBLE(k->p11);
+    f->nu2 = (float)KALMAN_NUM_TO_DOUBLE(k->nu2);
+    f->outliers = k->outliers;
+    f->last_seen = k->last_seen;
+    f->init = k->init;
+}
+
+void kalman_store_set(kalman_store_t *s, uint32_t slot, kalman_t const *f) {
+    kalman_slot_t *k = &s->slots[slot];
+    k->x0 = KALMAN_NUM(f->state[0]);
+    k->x1 = KALMAN_NUM(f->state[1]);
+    k->p00 = KALMAN_NUM(f->P[0][0]);
+    k->p01 = KALMAN_NUM(f->P[0][1]);
+    k->p10 = KALMAN_NUM(f->P[1][0]);
+    k->p11 = KALMAN_NUM(f->P[1][1]);
+    k->nu2 = KALMAN_NU2(f->nu2);
+    k->outliers = f->outliers;
+    k->last_seen = f->last_seen;
+    k->init = f->init;
+}
+
+static void kalman_store_update(kalman_store_t *s,
+                                kalman_profile_t const *profiles,
+                                uint32_t slot, uint8_t profile, int8_t z,
+                                double ts, double *rssi, double *var,
+                                bool *gated)
+/* One measurement stepped in place */
+{
+    kalman_slot_t *k = &s->slots[slot];
+    kalman_profile_t const *pr = &profiles[profile];
+    if (!k->init) {
+        /* First sighting, nothing to step */
+        k->x0 = KALMAN_NUM((double)z);
+        k->x1 = 0;
+        k->p00 = KALMAN_NUM(pr->p00);
+        k->p01 = KALMAN_NUM(pr->p01);
+        k->p10 = KALMAN_NUM(pr->p01);
+        k->p11 = KALMAN_NUM(pr->p11);
+        k->nu2 = KALMAN_NU2(pr->r + pr->p00);
+        k->outliers = 0;
+        k->last_seen = ts;
+        k->init = true;
+        *rssi = z;
+        *var = KALMAN_NUM_TO_DOUBLE(k->p00);
+        *gated = false;
+        return;
+    }
+    kalman_num_t r = KALMAN_NUM(pr->r), innov, innov_var;
+    kalman_store_step(&k->x0, &k->x1, &k->p00, &k->p01, &k->p10, &k->p11,
+                      &k->last_seen, &k->nu2, &k->outliers, KALMAN_NUM(pr->q),
+                      &r, KALMAN_NUM(pr->alpha),
+                      KALMAN_NUM(pr->gate * pr->gate), pr->gate_drop, z, ts,
+                      &innov, &innov_var, gated);
+    *rssi = KALMAN_NUM_TO_DOUBLE(k->x0);
+    *var = KALMAN_NUM_TO_DOUBLE(k->p00);
+
+    kalman_innovation_t *in = &s->innovation[profile];
+    double const nu = KALMAN_NUM_TO_DOUBLE(innov);
+    in->updates++;
+    in->gated += *gated;
+    in->sum += nu;
+    in->sum_sq += nu * nu;
+    in->sum_nis += nu * nu / KALMAN_NUM_TO_DOUBLE(innov_var);
+    in->sum_r += KALMAN_NUM_TO_DOUBLE(r);
+}
+
+void kalman_batch(kalman_store_t *s, kalman_profile_t const *profiles,
+                  uint32_t const *slot, uint8_t const *profile,
+                  int8_t const *z, double const *ts, double *rssi,
+                  double *var, bool *gated, size_t n)
+/* Apply up to KALMAN_BATCH_MAX measurements, z[i] at ts[i] to the
+   filter in slot[i] tuned by profiles[profile[i]], writing the
+   filtered RSSI, its variance and whether the measurement was gated
+   as an outlier. A slot may appear more than once; its updates are
+   applied in order, exactly as calling kalman() for each would */
+{
+    size_t const m = n < KALMAN_BATCH_MAX ? n : KALMAN_BATCH_MAX;
+    for (size_t i = 0; i < m; i++) {
+        kalman_store_update(s, profiles, slot[i], profile[i], z[i], ts[i],
+                            &rssi[i], &var[i], &gated[i]);
+    }
+}
@@ -4,13 +4,50 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#include "hash.h"
-
+/* Defaults for the profile settings in the config file's kalman group */
 #define Q_SPECTRAL_DENSITY 0.1225 /* variance of process noise */
 //#define Q_SPECTRAL_DENSITY 0.005 /* variance of process noise */
 #define MEASUREMENT_VARIANCE 9
+/* Initial covariance calibrated via usb dongle and dev board */
+#define KALMAN_P00_INIT 1.2
+#define KALMAN_P01_INIT 0.45
+#define KALMAN_P11_INIT 0.34
+#define KALMAN_ADAPTIVE_WINDOW 32 /* Adverts an estimate of R averages */
+/* An estimated R stays within this factor of the configured one */
+#define KALMAN_ADAPTIVE_RANGE 10.0
+#define KALMAN_MEASUREMENT_VARIANCE_MAX 1000.0 /* Largest R configurable */
+#define KALMAN_GATE_MAX 100.0 /* Widest gate, in standard deviations */
+/* Outliers gated in a row before the next measurement is taken as is,
+   so a filter that has lost track locks back on */
+#define KALMAN_GATE_RUN_MAX 3
+
+/* Filter tuning, one per beacon class and then per iBeacon UUID */
+enum kalman_profiles {
+    KALMAN_PROFILE_IBEACON = 0,
+    KALMAN_PROFILE_SECURE,
+    KALMAN_PROFILE_UUID
+};
+#define KALMAN_PROFILE_MAX 16
 
-#define HASH_TABLE_LEN_PRIME 251
+typedef struct kalman_profile {
+    double q;             /* Process noise spectral density */
+    double r;             /* Measurement variance */
+    double p00, p01, p11; /* Initial covariance */
+    /* Weight of each innovation in the running estimate of R, 0 to
+       keep R as configured */
+    double alpha;
+    /* Innovations over gate standard deviations are outliers, down
+       weighted onto the gate or with gate_drop dropped; 0 for none */
+    double gate;
+    bool gate_drop;
+} kalman_profile_t;
+
+#define KALMAN_PROFILE_DEFAULT                                                 \
+    {                                                                          \
+        .q = Q_SPECTRAL_DENSITY, .r = MEASUREMENT_VARIANCE,                    \
+        .p00 = KALMAN_P00_INIT, .p01 = KALMAN_P01_INIT,                        \
+        .p11 = KALMAN_P11_INIT, .alpha = 0, .gate = 0, .gate_drop = false      \
+    }
 
 typedef double p_noise_t[2][2];
 typedef double covariance_t[2][2];
@@ -21,15 +58,80 @@ typedef struct kalman_parameters {
     state_t state;
     covariance_t P;
     bool init;
+    uint8_t outliers; /* Gated in a row */
+    float nu2; /* Running mean square innovation, for adaptive R */
     double last_seen;
 } kalman_t;
 
-typedef struct generic_hashable_filterable {
-    hashable_t *next, *prev;
-    kalman_t kalman;
+/* The same filter in Q16.16 fixed point, for targets without an FPU */
+typedef int32_t q16_t;
+
+#define Q16_ONE ((q16_t)1 << 16)
+#define Q16(x) ((q16_t)((x)*Q16_ONE + ((x) < 0 ? -0.5 : 0.5)))
+#define Q16_TO_DOUBLE(x) ((double)(x) / Q16_ONE)
+#define KALMAN_FIXED_DT_MAX 30.0 /* Longest gap; keeps dt^3 in range */
+
+typedef struct kalman_fixed {
+    q16_t state[2];
+    q16_t P[2][2];
+    bool init;
+    uint8_t outliers;
+    q16_t nu2;
     double last_seen;
-} hashable_filterable_t;
+} kalman_fixed_t;
+
+double kalman(kalman_t *, kalman_profile_t const *, int8_t, double);
+double kalman_fixed(kalman_fixed_t *, kalman_profile_t const *, int8_t,
+                    double);
+
+#define KALMAN_BATCH_MAX 64 /* Updates applied in one pass */
+
+/* Beacon filters live in a kalman_store_t, in the double or, built
+   with KALMAN_FIXED, the Q16.16 flavour */
+#ifdef KALMAN_FIXED
+typedef q16_t kalman_num_t;
+typedef q16_t kalman_nu2_t;
+#else
+typedef double kalman_num_t;
+typedef float kalman_nu2_t;
+#endif
+
+/* One filter in the store, a cache line in the double flavour */
+typedef struct kalman_slot {
+    kalman_num_t x0, x1;               /* State */
+    kalman_num_t p00, p01, p10, p11;   /* Covariance */
+    double last_seen;
+    kalman_nu2_t nu2;
+    bool init;
+    uint8_t outliers;
+} __attribute__((aligned(64))) kalman_slot_t;
+
+/* How the innovations (measurement less prediction) of one profile's
+   filters behave: for a well tuned filter their mean is near 0 and
+   the mean normalised innovation squared near 1 */
+typedef struct kalman_innovation {
+    uint64_t updates;
+    uint64_t gated;     /* Updates that were outliers */
+    double sum, sum_sq; /* Of innovations, dB */
+    double sum_nis;     /* Of innovation^2 over its predicted variance */
+    double sum_r;       /* Of the measurement variance used */
+} kalman_innovation_t;
+
+/* Filter states indexed by slot, each updated in place */
+typedef struct kalman_store {
+    kalman_slot_t *slots;
+    uint32_t *free_slots; /* Stack of released slots */
+    size_t len, cap, nfree;
+    kalman_innovation_t innovation[KALMAN_PROFILE_MAX];
+} kalman_store_t;
 
-double kalman(void *, int8_t, double);
+int64_t kalman_store_alloc(kalman_store_t *);
+void kalman_store_free(kalman_store_t *, uint32_t);
+void kalman_store_destroy(kalman_store_t *);
+void kalman_store_get(kalman_store_t const *, uint32_t, kalman_t *);
+void kalman_store_set(kalman_store_t *, uint32_t, kalman_t const *);
+void kalman_batch(kalman_store_t *, kalman_profile_t const *,
+                  uint32_t const *, uint8_t const *, int8_t const *,
+                  double const *, double *, double *, bool *, size_t);
 
 #endif
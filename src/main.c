@@ -23,14 +23,21 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "accept_list.h"
 #include "beacon.h"
+#include "bench.h"
 #include "ble.h"
 #include "config.h"
+#include "hash.h"
 #include "http.h"
+#include "ingest.h"
 #include "ipc-privileged.h"
 #include "ipc.h"
 #include "log.h"
+#include "replay.h"
 #include "report.h"
+#include "sim.h"
+#include "snapshot.h"
 #include "udp.h"
 
 #define EVLOOP_NO_EXIT_ON_EMPTY 0x04
@@ -43,8 +50,7 @@ static void log_cb(int severity, const char *msg) {
 }
 
 /* Config and other globals */
-int dd = 0, child_pid = 0;
-const uint8_t filter_type = 0, filter_dup = 0;
+int child_pid = 0;
 
 /* Sockets linking parent and child for IPC */
 int ipc_sock_pair[2];
@@ -53,6 +59,8 @@ extern struct bufferevent *ipc_bev;
 void sigint_handler(int);
 void do_parent(void);
 void do_child(void);
+void do_replay(void);
+void do_simulate(void);
 
 int main(int argc, char **argv) {
     config_start(argc, argv);
@@ -65,6 +73,25 @@ int main(int argc, char **argv) {
     log_notice("Starting c3listener %s\n", PACKAGE_VERSION);
     fflush(stdout);
 
+    if (config_benchmark()) {
+        int r = bench_run();
+        config_cleanup();
+        return r;
+    }
+
+    /* Recorded or simulated traffic needs neither root nor a
+       controller */
+    if (config_get_replay_file()) {
+        do_replay();
+        config_cleanup();
+        return errno;
+    }
+    if (config_get_sim_tags()) {
+        do_simulate();
+        config_cleanup();
+        return errno;
+    }
+
     /* Daemonize */
     if (!config_debug()) {
         if (daemon(0, 0)) {
@@ -74,8 +101,8 @@ int main(int argc, char **argv) {
     }
 
     /* Setup BLE pre-fork, child will not have permissions */
-    dd = ble_init(config_get_hci_interface());
-    evutil_make_socket_nonblocking(dd);
+    ble_init();
+    accept_list_probe();
 
     /* Setup sockets for parent/child IPC */
     errno = 0;
@@ -121,9 +148,21 @@ void do_parent(void) {
     event_base_dispatch(p_base);
 }
 
+static void child_term_cb(evutil_socket_t fd, short what, void *arg)
+/* Save beacon state on the way out so the next run resumes from it */
+{
+    UNUSED(fd);
+    UNUSED(what);
+    snapshot_save();
+    event_base_loopbreak(arg);
+}
+
 void do_child(void) {
     /* In the child */
 
+    /* Key the beacon tables so adverts can't be crafted to collide */
+    hash_seed_random();
+
     struct event_base *c_base = event_base_new();
 
     /* Setup Web Server, pre-fork to get low port */
@@ -149,6 +188,7 @@ void do_child(void) {
         raise(SIGTERM);
         exit(EINVAL);
     }
+    snapshot_prepare(pw->pw_uid, pw->pw_gid);
     if (setgid(pw->pw_gid) == -1) {
         log_error("Failed to drop group privileges: %s", strerror(errno));
         raise(SIGTERM);
@@ -162,25 +202,63 @@ void do_child(void) {
     log_notice("Dropped privileges to %s (%d:%d)\n)", user, pw->pw_uid,
                pw->pw_gid);
 
-    /* Setup a bufferevent to process BLE scan results */
-    struct bufferevent *ble_bev = bufferevent_socket_new(c_base, dd, 0);
-    bufferevent_setcb(ble_bev, ble_readcb, NULL, NULL, NULL);
-    bufferevent_enable(ble_bev, EV_READ);
-    bufferevent_setwatermark(ble_bev, EV_READ, sizeof(ble_report_hdr_t), 0);
+    /* Start draining BLE scan results */
+    if (ingest_start(c_base, config_get_ingest_backend()) < 0) {
+        raise(SIGTERM);
+        exit(EIO);
+    }
+
+    /* Program the controller's filter accept list, if configured */
+    accept_list_init(c_base);
 
     /* Setup a bufferevent to write to and ack the server */
     udp_init(-1, 0, c_base);
 
     /* Setup a timer for sending report */
-    struct event *report_ev =
-        event_new(c_base, -1, EV_PERSIST, report_cb, NULL);
-    struct timeval report_tv = config_get_report_interval();
-    evtimer_add(report_ev, &report_tv);
+    report_init(c_base);
+
+    /* Forget beacons that have gone quiet */
+    beacon_gc_init(c_base);
+
+    /* Pick up where the last run left off, and keep saving */
+    snapshot_init(c_base);
+    struct event *term_ev = evsignal_new(c_base, SIGTERM, child_term_cb,
+                                         c_base);
+    evsignal_add(term_ev, NULL);
 
     /* Loop on established events */
     event_base_dispatch(c_base);
 }
 
+void do_replay(void) {
+    struct event_base *r_base = event_base_new();
+
+    ble_init_offline();
+    udp_init(-1, 0, r_base);
+
+    /* Reports and beacon expiry follow the capture's clock at any
+       speed, driven by the replay itself */
+    if (replay_start(r_base, config_get_replay_file(),
+                     config_get_replay_speed()) < 0) {
+        exit(EINVAL);
+    }
+    event_base_dispatch(r_base);
+}
+
+void do_simulate(void) {
+    struct event_base *s_base = event_base_new();
+
+    ble_init_offline();
+    udp_init(-1, 0, s_base);
+
+    /* Reports are driven by the simulation's virtual clock */
+    if (sim_start(s_base, config_get_sim_tags(), config_get_sim_duration(),
+                  config_get_sim_seed()) < 0) {
+        exit(ENOMEM);
+    }
+    event_base_dispatch(s_base);
+}
+
 void sigint_handler(int signum) {
     log_notice("Parent got signal: %d\n", signum);
     if (child_pid > 0) {
@@ -189,16 +267,7 @@ void sigint_handler(int signum) {
         kill(child_pid, SIGTERM);
     }
     config_cleanup();
-    if (hci_le_set_scan_enable(dd, 0x00, filter_dup, 1000) < 0) {
-        log_error("Disable scan failed", strerror(errno));
-    } else {
-        log_notice("Scan disabled\n");
-    }
-    if (hci_close_dev(dd) < 0) {
-        log_error("Closing HCI Socket Failed\n");
-    } else {
-        log_notice("HCI Socket Closed\n");
-    }
+    ble_cleanup();
     sync();
     fflush(stderr);
     exit(errno);
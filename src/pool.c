@@ -0,0 +1,96 @@
+/* pool.c - Fixed size object pool
+ *
+ *   Objects are carved out of POOL_SLAB_SIZE slabs and recycled through
+ *   a free list threaded through the free objects themselves. Slabs
+ *   are never handed back, so a long running process holds at most its
+ *   high water of slabs and the small object churn of beacons coming
+ *   and going never reaches the heap to fragment it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+typedef struct pool_slab {
+    struct pool_slab *next;
+} pool_slab_t;
+
+/* Objects start this far into a slab */
+#define POOL_SLAB_HDR                                                          \
+    ((sizeof(pool_slab_t) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+void pool_init(pool_t *p, size_t obj_size, size_t cap)
+/* Objects of obj_size bytes, using at most cap bytes of slabs */
+{
+    memset(p, 0, sizeof(*p));
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    p->obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    p->per_slab = (POOL_SLAB_SIZE - POOL_SLAB_HDR) / p->obj_size;
+    p->cap = cap;
+}
+
+static int pool_grow(pool_t *p) {
+    if (p->cap && p->stats.bytes + POOL_SLAB_SIZE > p->cap) {
+        return -1;
+    }
+    pool_slab_t *slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) {
+        return -1;
+    }
+    slab->next = p->slabs;
+    p->slabs = slab;
+    /* Thread the new objects onto the free list, lowest address first */
+    uint8_t *obj = (uint8_t *)slab + POOL_SLAB_HDR;
+    for (size_t i = p->per_slab; i > 0; i--) {
+        void **o = (void **)(obj + (i - 1) * p->obj_size);
+        *o = p->free_list;
+        p->free_list = o;
+    }
+    p->stats.slabs++;
+    p->stats.bytes += POOL_SLAB_SIZE;
+    p->stats.free += p->per_slab;
+    return 0;
+}
+
+void *pool_alloc(pool_t *p)
+/* A zeroed object, or NULL once the cap is reached */
+{
+    if (!p->free_list && pool_grow(p) < 0) {
+        p->stats.failures++;
+        return NULL;
+    }
+    void **o = p->free_list;
+    p->free_list = *o;
+    memset(o, 0, p->obj_size);
+    p->stats.free--;
+    if (++p->stats.live > p->stats.high_water) {
+        p->stats.high_water = p->stats.live;
+    }
+    return o;
+}
+
+void pool_free(pool_t *p, void *obj) {
+    if (!obj) {
+        return;
+    }
+    void **o = obj;
+    *o = p->free_list;
+    p->free_list = o;
+    p->stats.live--;
+    p->stats.free++;
+}
+
+void pool_destroy(pool_t *p)
+/* Release every slab; all objects must be dead */
+{
+    pool_slab_t *slab = p->slabs;
+    while (slab) {
+        pool_slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool_init(p, p->obj_size, p->cap);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_SLAB_SIZE 16384 /* Bytes requested from the heap at a time */
+#define POOL_ALIGN 16
+
+typedef struct pool_stats {
+    size_t live;       /* Objects handed out */
+    size_t free;       /* Objects ready for reuse in allocated slabs */
+    size_t high_water; /* Most objects live at once */
+    size_t slabs;
+    size_t bytes;      /* Heap held by the slabs */
+    uint64_t failures; /* Allocations refused by the memory cap */
+} pool_stats_t;
+
+typedef struct pool {
+    size_t obj_size, per_slab;
+    size_t cap; /* Bytes, 0 for no limit */
+    void *free_list;
+    void *slabs;
+    pool_stats_t stats;
+} pool_t;
+
+void pool_init(pool_t *, size_t, size_t);
+void *pool_alloc(pool_t *);
+void pool_free(pool_t *, void *);
+void pool_destroy(pool_t *);
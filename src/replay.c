@@ -0,0 +1,327 @@
+/* replay.c - Feed recorded HCI traffic through the parser
+ *
+ *   Reads btsnoop captures (btmon -w, Android HCI snoop logs) and pcap
+ *   captures (tcpdump -i bluetooth0, Wireshark) and hands the HCI
+ *   events in them to ble_parse_batch, the same entry point the ingest
+ *   backends use for a live socket. Packets are paced by their capture
+ *   timestamps scaled by the replay speed, or with a speed of 0 pushed
+ *   through as fast as the pipeline will take them. Either way they
+ *   keep their capture time and the virtual clock follows the capture,
+ *   so the filters, reports and beacon expiry see the same times at
+ *   any speed and however fast the host is.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <event2/event.h>
+
+#include "beacon.h"
+#include "ble.h"
+#include "config.h"
+#include "log.h"
+#include "replay.h"
+#include "report.h"
+#include "time_util.h"
+
+#define BTSNOOP_HDR_LEN 16
+#define BTSNOOP_REC_LEN 24
+#define BTSNOOP_FLAG_EVENT 0x03 /* Command/event, controller to host */
+#define PCAP_HDR_LEN 24
+#define PCAP_REC_LEN 16
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_PHDR_LEN 4 /* Direction preceding the H4 packet */
+#define REPLAY_FLUSH_USEC 100000 /* Let the last report reach the wire */
+
+static FILE *replay_file = NULL;
+static enum replay_format replay_format;
+static bool replay_swapped = false; /* pcap written on the other endian */
+static bool replay_nsec = false;
+static double replay_speed = 1.0;
+/* Monotonic time the replay started: the first packet's capture time
+   and when it is due */
+static double replay_wall_start = 0;
+static double replay_started = 0;
+static int64_t replay_first_usec = -1;
+static bool replay_pending = false; /* Slot 0 holds a packet not yet due */
+static struct event *replay_ev = NULL;
+
+static replay_stats_t replay_stats = {0};
+static ble_pkt_t replay_batch[REPLAY_CHUNK];
+static uint8_t replay_bufs[REPLAY_CHUNK][HCI_MAX_EVENT_SIZE];
+
+replay_stats_t const *replay_get_stats(void) {
+    return &replay_stats;
+}
+
+static char const *replay_format_name(enum replay_format format) {
+    switch (format) {
+    case REPLAY_BTSNOOP_H1:
+        return "btsnoop/h1";
+    case REPLAY_BTSNOOP_H4:
+        return "btsnoop/h4";
+    case REPLAY_PCAP_H4:
+        return "pcap/h4";
+    default:
+        return "pcap/h4+phdr";
+    }
+}
+
+static uint32_t replay_be32(uint8_t const *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static uint32_t replay_pcap32(uint8_t const *p)
+/* pcap fields are in the byte order of the host that wrote them */
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return replay_swapped ? __builtin_bswap32(v) : v;
+}
+
+static bool replay_open(const char *path) {
+    uint8_t hdr[PCAP_HDR_LEN];
+    if (!(replay_file = fopen(path, "rb"))) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (fread(hdr, 1, BTSNOOP_HDR_LEN, replay_file) != BTSNOOP_HDR_LEN) {
+        log_error("%s: too short for a capture file", path);
+        return false;
+    }
+    if (!memcmp(hdr, "btsnoop\0", 8)) {
+        uint32_t datalink = replay_be32(hdr + 12);
+        if (datalink == 1001) {
+            replay_format = REPLAY_BTSNOOP_H1;
+        } else if (datalink == 1002) {
+            replay_format = REPLAY_BTSNOOP_H4;
+        } else {
+            log_error("%s: unsupported btsnoop datalink %" PRIu32, path,
+                      datalink);
+            return false;
+        }
+        return true;
+    }
+
+    if (fread(hdr + BTSNOOP_HDR_LEN, 1, PCAP_HDR_LEN - BTSNOOP_HDR_LEN,
+              replay_file) != PCAP_HDR_LEN - BTSNOOP_HDR_LEN) {
+        log_error("%s: too short for a capture file", path);
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, hdr, sizeof(magic));
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        magic = __builtin_bswap32(magic);
+        replay_swapped = true;
+    }
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        log_error("%s: not a btsnoop or pcap file", path);
+        return false;
+    }
+    replay_nsec = magic == PCAP_MAGIC_NSEC;
+    uint32_t linktype = replay_pcap32(hdr + 20);
+    if (linktype == 187) {
+        replay_format = REPLAY_PCAP_H4;
+    } else if (linktype == 201) {
+        replay_format = REPLAY_PCAP_H4_PHDR;
+    } else {
+        log_error("%s: unsupported pcap linktype %" PRIu32, path, linktype);
+        return false;
+    }
+    return true;
+}
+
+static int replay_read(uint8_t *buf, size_t *len, int64_t *usec)
+/* Read the next HCI event in the capture into buf, skipping all other
+   traffic. Returns 1, 0 at the end of the file or -1 if the file is
+   corrupt */
+{
+    uint8_t rec[BTSNOOP_REC_LEN];
+    while (1) {
+        uint32_t incl;
+        size_t off = 0;
+        bool skip = false;
+        if (replay_format == REPLAY_BTSNOOP_H1 ||
+            replay_format == REPLAY_BTSNOOP_H4) {
+            if (fread(rec, 1, BTSNOOP_REC_LEN, replay_file) !=
+                BTSNOOP_REC_LEN) {
+                return 0;
+            }
+            incl = replay_be32(rec + 4);
+            *usec = (int64_t)((uint64_t)replay_be32(rec + 16) << 32 |
+                              replay_be32(rec + 20));
+            if (replay_format == REPLAY_BTSNOOP_H1) {
+                /* No packet type on the wire, the flags tell us */
+                skip = (replay_be32(rec + 8) & BTSNOOP_FLAG_EVENT) !=
+                       BTSNOOP_FLAG_EVENT;
+                buf[0] = HCI_EVENT_PKT;
+                off = 1;
+            }
+        } else {
+            if (fread(rec, 1, PCAP_REC_LEN, replay_file) != PCAP_REC_LEN) {
+                return 0;
+            }
+            uint32_t frac = replay_pcap32(rec + 4);
+            incl = replay_pcap32(rec + 8);
+            *usec = (int64_t)replay_pcap32(rec) * 1000000 +
+                    (replay_nsec ? frac / 1000 : frac);
+            if (replay_format == REPLAY_PCAP_H4_PHDR) {
+                if (incl < PCAP_PHDR_LEN ||
+                    fseek(replay_file, PCAP_PHDR_LEN, SEEK_CUR)) {
+                    return -1;
+                }
+                incl -= PCAP_PHDR_LEN;
+            }
+        }
+        replay_stats.packets++;
+
+        if (skip || incl == 0 || incl + off > HCI_MAX_EVENT_SIZE) {
+            if (fseek(replay_file, incl, SEEK_CUR)) {
+                return -1;
+            }
+            continue;
+        }
+        if (fread(buf + off, 1, incl, replay_file) != incl) {
+            return -1;
+        }
+        if (buf[0] != HCI_EVENT_PKT) {
+            continue;
+        }
+        *len = incl + off;
+        return 1;
+    }
+}
+
+static bool replay_next(size_t slot)
+/* Load the next event into a batch slot, timestamped with its capture
+   time on our clock */
+{
+    ble_pkt_t *pkt = &replay_batch[slot];
+    int64_t usec;
+    int r = replay_read(replay_bufs[slot], &pkt->len, &usec);
+    if (r < 0) {
+        log_error("Capture file is truncated or corrupt");
+    }
+    if (r <= 0) {
+        return false;
+    }
+    if (replay_first_usec < 0) {
+        replay_first_usec = usec;
+    }
+    double offset = (double)(usec - replay_first_usec) / 1E6;
+    replay_stats.span = offset;
+    pkt->data = replay_bufs[slot];
+    pkt->adapter = 0;
+    pkt->ts = replay_wall_start + offset;
+    return true;
+}
+
+static double replay_due(ble_pkt_t const *pkt)
+/* The monotonic time a paced packet is handed over */
+{
+    return replay_wall_start + (pkt->ts - replay_wall_start) / replay_speed;
+}
+
+static void replay_finish(struct event_base *base) {
+    replay_stats.elapsed = time_monotonic() - replay_started;
+    log_notice("Replayed %" PRIu64 " events (%" PRIu64
+               " records, %.1fs of capture) in %.3fs: %.0f events/s",
+               replay_stats.events, replay_stats.packets, replay_stats.span,
+               replay_stats.elapsed,
+               replay_stats.elapsed > 0
+                   ? replay_stats.events / replay_stats.elapsed
+                   : 0);
+    ble_log_filter_stats();
+    fclose(replay_file);
+    replay_file = NULL;
+    /* Send whatever the last report interval collected */
+    report_cb(-1, 0, NULL);
+    struct timeval flush_tv = {0, REPLAY_FLUSH_USEC};
+    event_base_loopexit(base, &flush_tv);
+}
+
+static void replay_cb(evutil_socket_t fd, short what, void *arg)
+/* Hand the next chunk of due packets to the parser */
+{
+    UNUSED(fd);
+    UNUSED(what);
+    struct event_base *base = arg;
+    double now = time_monotonic();
+    bool eof = false;
+    size_t n;
+
+    /* Parse at most one chunk per loop iteration so reports and HTTP
+       still get serviced in as fast as possible mode */
+    for (n = 0; n < REPLAY_CHUNK; n++) {
+        if (!replay_pending && !replay_next(n)) {
+            eof = true;
+            break;
+        }
+        replay_pending = true;
+        if (replay_speed > 0 && replay_due(&replay_batch[n]) > now) {
+            break;
+        }
+        replay_pending = false;
+    }
+    ble_parse_batch(replay_batch, n);
+    replay_stats.events += n;
+    if (n) {
+        /* Time moves with the capture, not the wall clock */
+        time_set_virtual(replay_batch[n - 1].ts);
+        report_tick(replay_batch[n - 1].ts);
+        beacon_gc(replay_batch[n - 1].ts);
+    }
+    if (eof) {
+        replay_finish(base);
+        return;
+    }
+
+    struct timeval tv = {0, 0};
+    if (replay_pending) {
+        if (n) {
+            memcpy(replay_bufs[0], replay_bufs[n], replay_batch[n].len);
+            replay_batch[0] = replay_batch[n];
+            replay_batch[0].data = replay_bufs[0];
+        }
+        double delay = replay_due(&replay_batch[0]) - now;
+        if (delay > 0) {
+            tv.tv_sec = (time_t)delay;
+            tv.tv_usec = (suseconds_t)((delay - tv.tv_sec) * 1E6);
+        }
+    }
+    evtimer_add(replay_ev, &tv);
+}
+
+int replay_start(struct event_base *base, const char *path, double speed)
+/* Start replaying a capture file into the event loop; the loop exits
+   once the file has been consumed */
+{
+    if (!replay_open(path)) {
+        if (replay_file) {
+            fclose(replay_file);
+            replay_file = NULL;
+        }
+        return -1;
+    }
+    replay_speed = speed;
+    replay_started = replay_wall_start = time_monotonic();
+    time_set_virtual(replay_wall_start);
+    if (speed > 0) {
+        log_notice("Replaying %s (%s) at %.2fx", path,
+                   replay_format_name(replay_format), speed);
+    } else {
+        log_notice("Replaying %s (%s) as fast as possible", path,
+                   replay_format_name(replay_format));
+    }
+    replay_ev = evtimer_new(base, replay_cb, base);
+    struct timeval tv = {0, 0};
+    return evtimer_add(replay_ev, &tv);
+}
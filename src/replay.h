@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#define REPLAY_CHUNK 64 /* Packets parsed per event loop iteration */
+
+enum replay_format {
+    REPLAY_BTSNOOP_H1 = 0, /* btsnoop datalink 1001, no packet type */
+    REPLAY_BTSNOOP_H4,     /* btsnoop datalink 1002 */
+    REPLAY_PCAP_H4,        /* pcap linktype 187 */
+    REPLAY_PCAP_H4_PHDR,   /* pcap linktype 201, direction prefixed */
+};
+
+typedef struct replay_stats {
+    uint64_t packets; /* Records read from the capture */
+    uint64_t events;  /* HCI event packets handed to the parser */
+    double elapsed;   /* Wall clock seconds spent replaying */
+    double span;      /* Seconds covered by the capture */
+} replay_stats_t;
+
+int replay_start(struct event_base *, const char *, double);
+replay_stats_t const *replay_get_stats(void);
@@ -34,29 +34,65 @@ static void report_add_header(struct evbuffer *buf, enum report_version version,
     return;
 }
 
+static report_stats_t report_stats = {0};
+
+report_stats_t const *report_get_stats(void) {
+    return &report_stats;
+}
+
 static void report_send(struct evbuffer *buf) {
     struct bufferevent *udp_bev = NULL;
+    size_t len = evbuffer_get_length(buf);
+    report_stats.reports++;
+    report_stats.bytes += len;
+    if (len > report_stats.largest) {
+        report_stats.largest = len;
+    }
     if ((udp_bev = udp_get_bev())) {
         bufferevent_write_buffer(udp_bev, buf);
     }
 }
 
+static struct event *report_ev = NULL;
+/* Config generation and interval the report timer was armed with */
+static uint64_t report_generation = 0;
+static struct timeval report_interval = {0, 0};
+
+void report_init(struct event_base *base)
+/* Send reports every report_interval */
+{
+    config_params_t const *params = config_params();
+    report_ev = event_new(base, -1, EV_PERSIST, report_cb, NULL);
+    report_generation = params->generation;
+    report_interval = params->report_interval;
+    evtimer_add(report_ev, &report_interval);
+}
+
+static void report_rearm(void)
+/* Follow report_interval changes made while running */
+{
+    config_params_t const *params = config_params();
+    if (!report_ev || params->generation == report_generation) {
+        return;
+    }
+    report_generation = params->generation;
+    if (timercmp(&params->report_interval, &report_interval, !=)) {
+        report_interval = params->report_interval;
+        evtimer_add(report_ev, &report_interval);
+    }
+}
+
 void report_cb(int a, short b, void *self) {
     UNUSED(a);
     UNUSED(b);
     UNUSED(self);
-    int cb_idx = 0;
-    walker_cb func[MAX_HASH_CB] = {NULL};
-    void *args[MAX_HASH_CB] = {NULL};
-
+    report_rearm();
     struct evbuffer *buf = evbuffer_new();
 
     report_add_header(buf, REPORT_VERSION_0, REPORT_PACKET_TYPE_DATA);
     size_t header_len = evbuffer_get_length(buf);
-    func[cb_idx] = report_ibeacon;
-    args[cb_idx] = &buf;
 
-    hash_walk(func, args, cb_idx);
+    beacon_walk_dirty(report_ibeacon, buf);
 
     /* If we generated a report this walk, send it */
     if (evbuffer_get_length(buf) > header_len) {
@@ -69,14 +105,36 @@ void report_cb(int a, short b, void *self) {
     evbuffer_free(buf);
 }
 
+void report_tick(double now)
+/* Run report_cb on the report interval of the virtual clock, for
+   simulation and fast replay where the event loop's timer would fire
+   on the wrong clock */
+{
+    static double next = NAN;
+    struct timeval const *tv = &config_params()->report_interval;
+    double interval = tv->tv_sec + tv->tv_usec / 1E6;
+    if (isnan(next)) {
+        next = now + interval;
+    }
+    if (now >= next) {
+        report_cb(-1, 0, NULL);
+        next += interval;
+        if (next <= now) {
+            /* Don't send a burst of reports over a gap in the input */
+            next = now + interval;
+        }
+    }
+}
+
 void report_secure(beacon_t const *const b, uint8_t const *const data,
                    size_t payload_len) {
     struct evbuffer *buf = evbuffer_new();
 
     report_add_header(buf, REPORT_VERSION_0, REPORT_PACKET_TYPE_SECURE);
 
-    struct sbeacon_id *id = b->id;
-    evbuffer_add(buf, id->mac, 6);
+    uint8_t mac[6];
+    sbeacon_key_mac(b->key, mac);
+    evbuffer_add(buf, mac, 6);
     /* Strip TX_POWER (last byte), it's not needed at the server */
     evbuffer_add(buf, data, payload_len - 1);
     uint16_t dist = round(b->distance * 100);
@@ -88,34 +146,30 @@ void report_secure(beacon_t const *const b, uint8_t const *const data,
     evbuffer_free(buf);
 }
 
-void *report_ibeacon(void *a, void *v) {
-    beacon_t *b = a;
+beacon_t *report_ibeacon(beacon_t *b, void *v) {
     struct evbuffer *buf = v;
 
-    /* Appends a beacon report to report buffer, funny return value
-       are to comply with walker_cb ABI */
+    /* Appends a beacon report to report buffer */
     if (!b->count || !(b->type == BEACON_IBEACON)) {
         /* If there are no new adverts or this isn't an ibeacon,
            skip */
-        a = beacon_expire(a, NULL);
-        return a;
+        return b;
     }
 
-    struct ibeacon_id *id = b->id;
+    uint16_t major = IBEACON_KEY_MAJOR(b->key);
+    uint16_t minor = IBEACON_KEY_MINOR(b->key);
 
-    evbuffer_add(buf, id->uuid, 16);
+    evbuffer_add(buf, beacon_uuid(IBEACON_KEY_UUID(b->key)), 16);
     uint16_t dist = round(b->distance * 100);
     uint16_t variance = round(b->variance * 100);
     /* Little endian, for reasons? */
-    uint8_t tmp[] = {(id->major & 0xff), (id->major >> 8),  (id->minor & 0xff),
-                     (id->minor >> 8),   (b->count & 0xff), (b->count >> 8),
+    uint8_t tmp[] = {(major & 0xff),     (major >> 8),      (minor & 0xff),
+                     (minor >> 8),       (b->count & 0xff), (b->count >> 8),
                      (dist & 0xff),      (dist >> 8),       (variance >> 8),
                      (variance & 0xff)};
     evbuffer_add(buf, tmp, sizeof(tmp));
     /* Reset beacon packet counter as it counts *unreported*
        packets */
     b->count = 0;
-    /* Returns pointer to current object since there is no barrier to
-       continuing the walk */
-    return a;
+    return b;
 }
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 
 enum report_version { REPORT_VERSION_0 = 0 };
 
@@ -10,6 +14,15 @@ enum report_packet_type {
     REPORT_PACKET_TYPE_SECURE = 2,
 };
 
+typedef struct report_stats {
+    uint64_t reports; /* Datagrams built, including keepalives */
+    uint64_t bytes;
+    size_t largest;
+} report_stats_t;
+
+void report_init(struct event_base *);
 void report_cb(int, short int, void *);
-void *report_ibeacon(void *a, void *b);
+void report_tick(double);
+report_stats_t const *report_get_stats(void);
+beacon_t *report_ibeacon(beacon_t *, void *);
 void report_secure(beacon_t const *const, uint8_t const *const, size_t);
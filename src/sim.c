@@ -0,0 +1,269 @@
+/* sim.c - Synthetic beacon population
+ *
+ *   Generates legacy advertising reports for a population of iBeacon
+ *   and secure beacon tags and feeds them through ble_parse_batch, so
+ *   the whole pipeline (beacon table, Kalman filters, report encoding,
+ *   UDP to the configured server) can be loaded without hardware.
+ *
+ *   Tags random walk around a square with the listener at its centre;
+ *   RSSI follows the log-distance path loss model with the configured
+ *   path_loss exponent plus Gaussian noise. Everything runs on the
+ *   virtual clock and draws from a seeded PRNG, so a run is repeatable
+ *   and goes as fast as the pipeline allows.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <event2/event.h>
+
+#include "beacon.h"
+#include "ble.h"
+#include "config.h"
+#include "ingest.h"
+#include "log.h"
+#include "report.h"
+#include "sim.h"
+#include "time_util.h"
+
+#define SIM_PKT_MAX 48 /* Legacy report event with 30 bytes of data */
+#define SIM_FLUSH_USEC 100000 /* Let the last report reach the wire */
+
+typedef struct sim_tag {
+    double next_adv, last_move;
+    float x, y; /* Metres from the listener */
+    uint8_t addr[6];
+    bool secure;
+} sim_tag_t;
+
+/* Flags AD, then the Apple iBeacon prefix up to the UUID */
+static uint8_t const sim_ibeacon_prefix[9] = {0x02, 0x01, 0x06, 0x1a, 0xff,
+                                              0x4c, 0x00, 0x02, 0x15};
+static uint8_t const sim_uuid[16] = {0xc3, 0x11, 0x57, 0xe1, 0x00, 0x00,
+                                     0x40, 0x00, 0x80, 0x00, 0x00, 0x00,
+                                     0x00, 0x00, 0x00, 0x01};
+
+static sim_tag_t *sim_tags = NULL;
+static sim_stats_t sim_stats = {0};
+static uint64_t sim_rng;
+static double sim_end = 0, sim_wall_start = 0;
+static clock_t sim_cpu_start;
+static struct event *sim_ev = NULL;
+
+static ble_pkt_t sim_batch[INGEST_BATCH_SIZE];
+static uint8_t sim_bufs[INGEST_BATCH_SIZE][SIM_PKT_MAX];
+
+sim_stats_t const *sim_get_stats(void) {
+    return &sim_stats;
+}
+
+static uint64_t sim_rand(void)
+/* xorshift64* */
+{
+    sim_rng ^= sim_rng >> 12;
+    sim_rng ^= sim_rng << 25;
+    sim_rng ^= sim_rng >> 27;
+    return sim_rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double sim_uniform(void)
+/* [0, 1) */
+{
+    return (sim_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double sim_gauss(void)
+/* Standard normal, Box-Muller */
+{
+    double u = 1.0 - sim_uniform();
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * sim_uniform());
+}
+
+static float sim_reflect(double v)
+/* Keep a coordinate inside the area by bouncing off its edges */
+{
+    double const half = SIM_AREA_M / 2;
+    while (v > half || v < -half) {
+        v = v > half ? 2 * half - v : -2 * half - v;
+    }
+    return v;
+}
+
+static void sim_move(sim_tag_t *tag, double now) {
+    double sigma = SIM_WALK_SIGMA_M * sqrt(now - tag->last_move);
+    tag->x = sim_reflect(tag->x + sigma * sim_gauss());
+    tag->y = sim_reflect(tag->y + sigma * sim_gauss());
+    tag->last_move = now;
+}
+
+static size_t sim_build(uint8_t *pkt, sim_tag_t const *tag, size_t idx,
+                        int8_t rssi)
+/* Encode one advert as a single report LE Advertising Report event,
+   laid out the way ble_process_report reads it */
+{
+    uint8_t len = tag->secure ? 30 : 29;
+    uint8_t *data = pkt + 14;
+    pkt[0] = HCI_EVENT_PKT;
+    pkt[1] = EVT_LE_META_EVENT;
+    pkt[2] = 12 + len; /* param_len */
+    pkt[3] = BLE_SUB_EVT_ADV_REPORT;
+    pkt[4] = 1;    /* num_reports */
+    pkt[5] = 0x03; /* ADV_NONCONN_IND */
+    pkt[6] = 0x01; /* Random address */
+    memcpy(pkt + 7, tag->addr, 6);
+    pkt[13] = len;
+    if (tag->secure) {
+        /* Stands in for the encrypted payload, fresh every advert */
+        for (uint8_t i = 0; i < len; i++) {
+            data[i] = sim_rand();
+        }
+        data[BLE_SECURE_TX_POWER] = SIM_TX_POWER;
+    } else {
+        memcpy(data, sim_ibeacon_prefix, sizeof(sim_ibeacon_prefix));
+        memcpy(data + 9, sim_uuid, 16);
+        data[25] = idx >> 24;
+        data[26] = idx >> 16;
+        data[27] = idx >> 8;
+        data[28] = idx;
+    }
+    data[len] = rssi;
+    return 14 + len + 1;
+}
+
+static void sim_finish(struct event_base *base) {
+    sim_stats.wall_sec = time_monotonic() - sim_wall_start;
+    sim_stats.cpu_sec = (double)(clock() - sim_cpu_start) / CLOCKS_PER_SEC;
+
+    beacon_stats_t const *bs = beacon_get_stats();
+    report_stats_t const *rs = report_get_stats();
+    log_notice("Simulated %zu tags for %.0fs in %.2fs (%.2fs CPU)",
+               sim_stats.tags, sim_stats.virtual_sec, sim_stats.wall_sec,
+               sim_stats.cpu_sec);
+    log_notice("%" PRIu64 " adverts (%" PRIu64 " lost), %.0f adverts/s, "
+               "%.2fus CPU per advert",
+               sim_stats.adverts, sim_stats.lost,
+               sim_stats.wall_sec > 0 ? sim_stats.adverts / sim_stats.wall_sec
+                                      : 0,
+               sim_stats.adverts ? sim_stats.cpu_sec * 1E6 / sim_stats.adverts
+                                 : 0);
+    log_notice("%zu beacons tracked, %" PRIu64 " reports, %.0f bytes average, "
+               "%zu largest",
+               bs->ibeacons + bs->sbeacons, rs->reports,
+               rs->reports ? (double)rs->bytes / rs->reports : 0,
+               rs->largest);
+    ble_log_filter_stats();
+    free(sim_tags);
+    sim_tags = NULL;
+    struct timeval flush_tv = {0, SIM_FLUSH_USEC};
+    event_base_loopexit(base, &flush_tv);
+}
+
+static void sim_cb(evutil_socket_t fd, short what, void *arg)
+/* Simulate one tick, then yield to the event loop so reports are
+   written out */
+{
+    UNUSED(fd);
+    UNUSED(what);
+    struct event_base *base = arg;
+    double const tick_end = time_now() + SIM_TICK_SEC;
+    double const path_loss = config_params()->path_loss;
+    size_t n = 0;
+
+    for (size_t i = 0; i < sim_stats.tags; i++) {
+        sim_tag_t *tag = &sim_tags[i];
+        if (tag->next_adv >= tick_end) {
+            continue;
+        }
+        double ts = tag->next_adv;
+        tag->next_adv +=
+            SIM_ADV_INTERVAL_SEC + SIM_ADV_JITTER_SEC * sim_uniform();
+        sim_move(tag, ts);
+        double dist = hypot(tag->x, tag->y);
+        if (dist < SIM_MIN_DIST_M) {
+            dist = SIM_MIN_DIST_M;
+        }
+        double rssi = SIM_TX_POWER - 10 * path_loss * log10(dist) +
+                      SIM_RSSI_SIGMA * sim_gauss();
+        if (sim_uniform() * 100 < SIM_MULTIPATH_PERCENT) {
+            rssi -= SIM_MULTIPATH_DB;
+        }
+        if (rssi < SIM_RX_SENSITIVITY) {
+            sim_stats.lost++;
+            continue;
+        }
+        if (rssi > INT8_MAX) {
+            rssi = INT8_MAX;
+        }
+        sim_batch[n].data = sim_bufs[n];
+        sim_batch[n].len = sim_build(sim_bufs[n], tag, i, lround(rssi));
+        sim_batch[n].ts = ts;
+        sim_batch[n].adapter = 0;
+        if (++n == INGEST_BATCH_SIZE) {
+            ble_parse_batch(sim_batch, n);
+            sim_stats.adverts += n;
+            n = 0;
+        }
+    }
+    ble_parse_batch(sim_batch, n);
+    sim_stats.adverts += n;
+
+    time_set_virtual(tick_end);
+    sim_stats.virtual_sec += SIM_TICK_SEC;
+    report_tick(tick_end);
+    beacon_gc(tick_end);
+    if (tick_end >= sim_end) {
+        sim_finish(base);
+        return;
+    }
+    struct timeval tv = {0, 0};
+    evtimer_add(sim_ev, &tv);
+}
+
+int sim_start(struct event_base *base, size_t tags, double duration,
+              uint64_t seed)
+/* Simulate tags for duration seconds of virtual time; the event loop
+   exits once done */
+{
+    if (!(sim_tags = calloc(tags, sizeof(sim_tag_t)))) {
+        log_error("Failed to allocate %zu simulated tags", tags);
+        return -1;
+    }
+    /* splitmix64 the seed so neighbouring seeds diverge */
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    sim_rng = (z ^ (z >> 31)) | 1;
+
+    time_set_virtual(0);
+    sim_end = duration;
+    sim_stats.tags = tags;
+    for (size_t i = 0; i < tags; i++) {
+        sim_tag_t *tag = &sim_tags[i];
+        tag->secure = sim_rand() % 100 < SIM_SECURE_PERCENT;
+        tag->x = (sim_uniform() - 0.5) * SIM_AREA_M;
+        tag->y = (sim_uniform() - 0.5) * SIM_AREA_M;
+        tag->next_adv = sim_uniform() * SIM_ADV_INTERVAL_SEC;
+        /* Static random address: top two bits set */
+        tag->addr[5] = 0xc0 | (tag->secure ? 0x01 : 0x00);
+        tag->addr[4] = i >> 24;
+        tag->addr[3] = i >> 16;
+        tag->addr[2] = i >> 8;
+        tag->addr[1] = i;
+        tag->addr[0] = 0x5a;
+    }
+    log_notice("Simulating %zu tags for %.0fs, seed %" PRIu64, tags, duration,
+               seed);
+
+    sim_wall_start = time_monotonic();
+    sim_cpu_start = clock();
+    sim_ev = evtimer_new(base, sim_cb, base);
+    struct timeval tv = {0, 0};
+    return evtimer_add(sim_ev, &tv);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#define SIM_TICK_SEC 0.1          /* Virtual time simulated per loop pass */
+#define SIM_ADV_INTERVAL_SEC 1.0  /* Advertising interval of every tag */
+#define SIM_ADV_JITTER_SEC 0.01   /* Random advDelay added per advert */
+#define SIM_AREA_M 30.0           /* Side of the square the tags roam */
+#define SIM_WALK_SIGMA_M 0.7      /* Std. dev. of a step per second */
+#define SIM_MIN_DIST_M 0.5        /* Closest a tag gets to the antenna */
+#define SIM_TX_POWER -59          /* RSSI at 1m */
+#define SIM_RSSI_SIGMA 4.0        /* Std. dev. of RSSI noise in dB */
+#define SIM_MULTIPATH_PERCENT 2   /* Share of adverts caught in a fade */
+#define SIM_MULTIPATH_DB 15.0     /* Depth of a multipath fade */
+#define SIM_RX_SENSITIVITY -100   /* Adverts weaker than this are lost */
+#define SIM_SECURE_PERCENT 10     /* Share of tags that are secure beacons */
+#define SIM_DEFAULT_DURATION_SEC 600
+#define SIM_DEFAULT_SEED 1
+
+typedef struct sim_stats {
+    size_t tags;
+    uint64_t adverts; /* Adverts delivered to the parser */
+    uint64_t lost;    /* Adverts below receiver sensitivity */
+    double virtual_sec;
+    double wall_sec;
+    double cpu_sec;
+} sim_stats_t;
+
+int sim_start(struct event_base *, size_t, double, uint64_t);
+sim_stats_t const *sim_get_stats(void);
@@ -0,0 +1,355 @@
+/* snapshot.c - Beacon state kept across restarts
+ *
+ *   Every SNAPSHOT_INTERVAL_SEC the tracked beacons, with their Kalman
+ *   filters, tx_power averages and how long ago they were heard, are
+ *   written to a memory mapped file under /run, and again when the
+ *   child is told to exit. On startup the file is read back, so after
+ *   a crash, config change or upgrade the filters resume converged
+ *   rather than starting over from the default covariance.
+ *
+ *   The file records the wall clock time it was written. Each filter is
+ *   restored as last heard that long plus its age ago, so its next
+ *   update predicts over the whole gap and the covariance grows to
+ *   match; only state older than SNAPSHOT_MAX_AGE_SEC is dropped.
+ *   Restored beacons that aren't heard again expire as usual after
+ *   MAX_BEACON_INACTIVE_SEC. iBeacon keys refer to interned UUIDs, so the
+ *   UUIDs are saved alongside and re-interned on load.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "beacon.h"
+#include "ble.h"
+#include "config.h"
+#include "log.h"
+#include "snapshot.h"
+#include "time_util.h"
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size; /* Catches a beacon layout change */
+    uint32_t uuids;
+    uint32_t beacons;
+    double saved; /* CLOCK_REALTIME */
+} snapshot_header_t;
+
+typedef struct snapshot_beacon {
+    beacon_key_t key;
+    double state[2];
+    double P[2][2];
+    double age; /* Seconds since last heard, when saved */
+    double distance, variance;
+    int8_t tx_power;
+    uint8_t init;
+    uint8_t outliers; /* Gated in a row */
+    uint8_t pad;
+    float nu2; /* Mean square innovation, for adaptive R */
+} snapshot_beacon_t;
+
+static char const snapshot_magic[8] = "c3snap\0";
+
+static snapshot_stats_t snapshot_stats = {0};
+static struct event *snapshot_ev = NULL;
+
+/* The save in progress: a file mapped for as many beacons as were
+   tracked when it started, filled in over a sliced walk */
+static struct snapshot_save {
+    uint8_t *map;
+    size_t size, cap, len;
+    int fd;
+    char tmp[PATH_MAX];
+    double started, now;
+    beacon_slicer_t *walk;
+} snapshot_cur = {.fd = -1};
+
+snapshot_stats_t const *snapshot_get_stats(void) {
+    return &snapshot_stats;
+}
+
+static double snapshot_realtime(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return timespec_to_seconds(t);
+}
+
+void snapshot_prepare(uid_t uid, gid_t gid)
+/* Create the snapshot directory for the user we'll run as; needs to
+   happen before privileges are dropped */
+{
+    char const *path = config_get_snapshot_file();
+    if (!*path) {
+        return;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return;
+    }
+    char const *dir = dirname(copy);
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+    } else if (chown(dir, uid, gid)) {
+        log_error("Failed to hand %s over: %s", dir, strerror(errno));
+    }
+    free(copy);
+}
+
+static void snapshot_abort(void) {
+    struct snapshot_save *s = &snapshot_cur;
+    if (s->walk) {
+        beacon_walk_cancel(s->walk);
+        s->walk = NULL;
+    }
+    if (s->map) {
+        munmap(s->map, s->size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+        unlink(s->tmp);
+    }
+}
+
+static bool snapshot_begin(void)
+/* Map a temporary file big enough for everything tracked now */
+{
+    struct snapshot_save *s = &snapshot_cur;
+    beacon_stats_t const *bs = beacon_get_stats();
+    s->cap = bs->ibeacons + bs->sbeacons;
+    s->len = 0;
+    s->size = sizeof(snapshot_header_t) + bs->uuids * 16 +
+              s->cap * sizeof(snapshot_beacon_t);
+    s->started = time_monotonic();
+    s->now = time_now();
+    snprintf(s->tmp, sizeof(s->tmp), "%s.tmp", config_get_snapshot_file());
+
+    if ((s->fd = open(s->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        log_error("Failed to create %s: %s", s->tmp, strerror(errno));
+        return false;
+    }
+    if (ftruncate(s->fd, s->size) ||
+        (s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       s->fd, 0)) == MAP_FAILED) {
+        log_error("Failed to map %s: %s", s->tmp, strerror(errno));
+        s->map = NULL;
+        snapshot_abort();
+        return false;
+    }
+
+    snapshot_header_t *h = (snapshot_header_t *)s->map;
+    memcpy(h->magic, snapshot_magic, sizeof(h->magic));
+    h->version = SNAPSHOT_VERSION;
+    h->rec_size = sizeof(snapshot_beacon_t);
+    h->uuids = bs->uuids;
+    uint8_t *uuids = s->map + sizeof(snapshot_header_t);
+    for (uint32_t i = 0; i < h->uuids; i++) {
+        memcpy(uuids + 16 * i, beacon_uuid(i), 16);
+    }
+    return true;
+}
+
+static beacon_t *snapshot_add(beacon_t *b, void *arg) {
+    UNUSED(arg);
+    struct snapshot_save *s = &snapshot_cur;
+    snapshot_header_t *h = (snapshot_header_t *)s->map;
+    if (s->len == s->cap) {
+        return b;
+    }
+    snapshot_beacon_t *r = (snapshot_beacon_t *)(s->map +
+                                                 sizeof(snapshot_header_t) +
+                                                 h->uuids * 16) +
+                           s->len++;
+    r->key = b->key;
+    kalman_t k = {0};
+    kalman_store_get(beacon_filters(), b->filter, &k);
+    memcpy(r->state, k.state, sizeof(r->state));
+    memcpy(r->P, k.P, sizeof(r->P));
+    r->age = s->now - k.last_seen;
+    r->distance = b->distance;
+    r->variance = b->variance;
+    r->tx_power = b->tx_power;
+    r->init = k.init;
+    r->outliers = k.outliers;
+    r->nu2 = k.nu2;
+    return b;
+}
+
+static bool snapshot_finish(void)
+/* Trim the file to the beacons written and move it into place */
+{
+    struct snapshot_save *s = &snapshot_cur;
+    snapshot_header_t *h = (snapshot_header_t *)s->map;
+    h->beacons = s->len;
+    h->saved = snapshot_realtime();
+    size_t size = sizeof(snapshot_header_t) + h->uuids * 16 +
+                  s->len * sizeof(snapshot_beacon_t);
+    munmap(s->map, s->size);
+    s->map = NULL;
+    char const *path = config_get_snapshot_file();
+    if (ftruncate(s->fd, size) || rename(s->tmp, path)) {
+        log_error("Failed to write %s: %s", path, strerror(errno));
+        snapshot_abort();
+        snapshot_stats.failures++;
+        return false;
+    }
+    close(s->fd);
+    s->fd = -1;
+    snapshot_stats.saves++;
+    snapshot_stats.saved = s->len;
+    snapshot_stats.bytes = size;
+    snapshot_stats.save_sec = time_monotonic() - s->started;
+    return true;
+}
+
+static void snapshot_done(void *arg) {
+    UNUSED(arg);
+    snapshot_cur.walk = NULL;
+    snapshot_finish();
+}
+
+bool snapshot_save(void)
+/* Save right away, in one go; for exit */
+{
+    if (!*config_get_snapshot_file()) {
+        return false;
+    }
+    snapshot_abort();
+    if (!snapshot_begin()) {
+        snapshot_stats.failures++;
+        return false;
+    }
+    beacon_walk(snapshot_add, NULL);
+    return snapshot_finish();
+}
+
+static void snapshot_cb(evutil_socket_t fd, short what, void *arg)
+/* Periodic save, sliced so a large table doesn't hold up ingest */
+{
+    UNUSED(fd);
+    UNUSED(what);
+    struct event_base *base = arg;
+    if (snapshot_cur.walk) {
+        /* Still writing the last one */
+        return;
+    }
+    if (!snapshot_begin()) {
+        snapshot_stats.failures++;
+        return;
+    }
+    snapshot_cur.walk =
+        beacon_walk_sliced(base, snapshot_add, snapshot_done, NULL);
+    if (!snapshot_cur.walk) {
+        snapshot_abort();
+        snapshot_stats.failures++;
+    }
+}
+
+static void snapshot_load(char const *path)
+/* Pick up the beacons saved by the last run that are still fresh */
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_error("Failed to open %s: %s", path, strerror(errno));
+        }
+        return;
+    }
+    struct stat st;
+    uint8_t *map = NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(snapshot_header_t) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+        log_error("Failed to read %s", path);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    snapshot_header_t const *h = (snapshot_header_t const *)map;
+    size_t const size = st.st_size;
+    /* head is only used once uuids is known to be in range; beacons is
+       checked against what the file holds, as multiplying it out can
+       wrap a 32 bit size_t */
+    size_t const head = sizeof(snapshot_header_t) + (size_t)h->uuids * 16;
+    if (memcmp(h->magic, snapshot_magic, sizeof(h->magic)) ||
+        h->version != SNAPSHOT_VERSION ||
+        h->rec_size != sizeof(snapshot_beacon_t) ||
+        h->uuids > BEACON_UUID_MAX || size < head ||
+        (size - head) % sizeof(snapshot_beacon_t) ||
+        h->beacons != (size - head) / sizeof(snapshot_beacon_t)) {
+        log_error("Ignoring %s, not a snapshot of this version", path);
+        munmap(map, size);
+        return;
+    }
+
+    /* UUID indices are handed out afresh */
+    uint8_t const *uuids = map + sizeof(snapshot_header_t);
+    int remap[BEACON_UUID_MAX];
+    for (uint32_t i = 0; i < h->uuids; i++) {
+        remap[i] = beacon_uuid_intern(uuids + 16 * i);
+    }
+
+    double since = snapshot_realtime() - h->saved;
+    double now = time_now();
+    snapshot_beacon_t const *r =
+        (snapshot_beacon_t const *)(uuids + h->uuids * 16);
+    for (uint32_t i = 0; i < h->beacons; i++, r++) {
+        double age = r->age + (since > 0 ? since : 0);
+        beacon_key_t key = r->key;
+        if (!(key & BEACON_KEY_SECURE)) {
+            uint16_t u = IBEACON_KEY_UUID(key);
+            if (u >= h->uuids || remap[u] < 0) {
+                continue;
+            }
+            key = IBEACON_KEY(remap[u], IBEACON_KEY_MAJOR(key),
+                              IBEACON_KEY_MINOR(key));
+        }
+        if (age > SNAPSHOT_MAX_AGE_SEC) {
+            snapshot_stats.stale++;
+            continue;
+        }
+        beacon_t *b = beacon_find_or_add(key);
+        if (!b) {
+            break;
+        }
+        kalman_t k = {0};
+        memcpy(k.state, r->state, sizeof(k.state));
+        memcpy(k.P, r->P, sizeof(k.P));
+        k.init = r->init;
+        k.outliers = r->outliers;
+        k.nu2 = r->nu2;
+        k.last_seen = now - age;
+        kalman_store_set(beacon_filters(), b->filter, &k);
+        b->distance = r->distance;
+        b->variance = r->variance;
+        b->tx_power = r->tx_power;
+        snapshot_stats.restored++;
+    }
+    munmap(map, size);
+    log_notice("Restored %zu beacons from %s, %zu were too old",
+               snapshot_stats.restored, path, snapshot_stats.stale);
+}
+
+void snapshot_init(struct event_base *base)
+/* Restore the last snapshot, then keep saving new ones */
+{
+    char const *path = config_get_snapshot_file();
+    if (!*path) {
+        return;
+    }
+    snapshot_load(path);
+    struct timeval tv = {SNAPSHOT_INTERVAL_SEC, 0};
+    snapshot_ev = event_new(base, -1, EV_PERSIST, snapshot_cb, base);
+    evtimer_add(snapshot_ev, &tv);
+}
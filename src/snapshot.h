@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "config.h"
+
+/* How often beacon state is saved, and the oldest state worth
+   restoring. A restored filter's next update predicts over its age
+   plus up to MAX_BEACON_INACTIVE_SEC; the Q16.16 filter clamps that
+   gap to KALMAN_FIXED_DT_MAX, so its state must be fresher for the
+   covariance to grow with the real gap */
+#ifdef KALMAN_FIXED
+#define SNAPSHOT_INTERVAL_SEC 10
+#define SNAPSHOT_MAX_AGE_SEC (KALMAN_FIXED_DT_MAX - MAX_BEACON_INACTIVE_SEC)
+#else
+#define SNAPSHOT_INTERVAL_SEC 30
+#define SNAPSHOT_MAX_AGE_SEC 300
+#endif
+#define SNAPSHOT_VERSION 2
+
+typedef struct snapshot_stats {
+    uint64_t saves;
+    uint64_t failures;
+    size_t saved;     /* Beacons in the last snapshot */
+    size_t bytes;     /* Size of the last snapshot */
+    double save_sec;  /* Time the last save took, over all its slices */
+    size_t restored;  /* Beacons picked back up at startup */
+    size_t stale;     /* Beacons in the file older than SNAPSHOT_MAX_AGE_SEC */
+} snapshot_stats_t;
+
+void snapshot_prepare(uid_t, gid_t);
+void snapshot_init(struct event_base *);
+bool snapshot_save(void);
+snapshot_stats_t const *snapshot_get_stats(void);
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -12,12 +13,60 @@ double timespec_to_seconds(const struct timespec tv) {
     return (double)tv.tv_sec + nsec_to_sec(tv.tv_nsec);
 }
 
-double time_now(void) {
+double timeval_to_seconds(const struct timeval tv) {
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1E6;
+}
+
+/* Simulation and fast replay run on a clock they advance themselves */
+static bool time_virtual = false;
+static double time_virtual_now = 0;
+
+double time_monotonic(void) {
     struct timespec t;
     clock_gettime(CLOCK_MONOTONIC, &t);
     return timespec_to_seconds(t);
 }
 
+double time_now(void) {
+    return time_virtual ? time_virtual_now : time_monotonic();
+}
+
+/* CLOCK_REALTIME minus CLOCK_MONOTONIC; the kernel stamps packets on
+   the wall clock */
+static double time_realtime_offset = 0;
+
+void time_sync_realtime(void)
+/* Refresh the wall clock offset, so that steps of the wall clock are
+   only felt until the next call */
+{
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    time_realtime_offset =
+        timespec_to_seconds(real) - timespec_to_seconds(mono);
+}
+
+double time_from_realtime(double real)
+/* Map a wall clock time onto the clock time_now() runs on */
+{
+    return real - time_realtime_offset;
+}
+
+void time_set_virtual(double now)
+/* Switch time_now() to the virtual clock, or move it to now */
+{
+    time_virtual = true;
+    time_virtual_now = now;
+}
+
+void time_advance(double dt) {
+    time_virtual_now += dt;
+}
+
+bool time_is_virtual(void) {
+    return time_virtual;
+}
+
 uint_fast32_t tv2ms(struct timeval time) {
     return (time.tv_sec * 1000 + time.tv_usec / 1000);
 }
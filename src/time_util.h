@@ -1,10 +1,18 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
 
 double timespec_to_seconds(const struct timespec);
+double timeval_to_seconds(const struct timeval);
 double time_now(void);
+double time_monotonic(void);
+void time_sync_realtime(void);
+double time_from_realtime(double);
+void time_set_virtual(double);
+void time_advance(double);
+bool time_is_virtual(void);
 uint_fast32_t tv2ms(struct timeval);
 char *time_desc_delta(double);
@@ -0,0 +1,110 @@
+/* wheel.c - Hierarchical timer wheel
+ *
+ *   Level 0 has a slot per tick for the next WHEEL_SLOTS ticks, each
+ *   level above covers WHEEL_SLOTS times the span of the one below.
+ *   Timers far out sit in a coarse slot and are redistributed to finer
+ *   levels as their time comes closer, so adding and removing a timer
+ *   is O(1) and advancing the wheel touches only the slots due plus
+ *   the occasional cascade, however many timers are pending.
+ */
+
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(wheel_t *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+static void wheel_link(wheel_timer_t **head, wheel_timer_t *t) {
+    t->next = *head;
+    t->pprev = head;
+    if (*head) {
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+}
+
+static void wheel_place(wheel_t *w, wheel_timer_t *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        /* Beyond the wheel; fire at its horizon instead */
+        t->expires = w->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    size_t slot = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_link(&w->slots[level][slot], t);
+}
+
+void wheel_add(wheel_t *w, wheel_timer_t *t, uint64_t expires)
+/* Arm t to fire at tick expires; ticks already passed fire on the
+   next one */
+{
+    t->expires = expires > w->now ? expires : w->now + 1;
+    wheel_place(w, t);
+    w->pending++;
+}
+
+void wheel_del(wheel_t *w, wheel_timer_t *t) {
+    if (!t->pprev) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    w->pending--;
+}
+
+static void wheel_cascade(wheel_t *w, int level) {
+    size_t slot = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_timer_t *t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    while (t) {
+        wheel_timer_t *next = t->next;
+        wheel_place(w, t);
+        t = next;
+    }
+}
+
+size_t wheel_advance(wheel_t *w, uint64_t now, wheel_cb cb, void *arg)
+/* Fire every timer due up to tick now. cb may re-arm or delete the
+   timer it is given. Returns the number fired */
+{
+    size_t fired = 0;
+    while (w->now < now) {
+        if (!w->pending) {
+            /* Nothing to cascade or fire on the way */
+            w->now = now;
+            break;
+        }
+        w->now++;
+        /* Crossing into a new slot of a level pulls its timers down,
+           coarsest first */
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 &&
+               !(w->now & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1))) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            wheel_cascade(w, level);
+        }
+        wheel_timer_t **head = &w->slots[0][w->now & WHEEL_MASK];
+        while (*head) {
+            wheel_timer_t *t = *head;
+            wheel_del(w, t);
+            cb(t, arg);
+            fired++;
+        }
+    }
+    return fired;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* Reaches 2^24 ticks ahead */
+
+/* Embedded in whatever is being timed */
+typedef struct wheel_timer {
+    struct wheel_timer *next, **pprev;
+    uint64_t expires; /* Tick */
+} wheel_timer_t;
+
+typedef void (*wheel_cb)(wheel_timer_t *, void *);
+
+typedef struct wheel {
+    uint64_t now; /* Last tick processed */
+    size_t pending;
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+void wheel_init(wheel_t *, uint64_t);
+void wheel_add(wheel_t *, wheel_timer_t *, uint64_t);
+void wheel_del(wheel_t *, wheel_timer_t *);
+size_t wheel_advance(wheel_t *, uint64_t, wheel_cb, void *);